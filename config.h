@@ -2,6 +2,12 @@
 #define __CONFIG__
 const int CONFIG_PROBE = 8;
 const int CONFIG_PIECE = 1024;
+const int CONFIG_BUFFER = 16;
 const float CONFIG_BULK = 0.25;
 const float CONFIG_NODESIZE = 10240;
+const int CONFIG_RADIX_BITS = 14; // 0 disables the radix table in front of the root
+const int CONFIG_FLAT_LEVELS = 2; // 0 disables the flattened snapshot of the upper inner levels
+const int CONFIG_OVERFLOW_DEPTH = 2; // the most nested overflow nodes under an inner bucket
+const int CONFIG_COMPACT_PIECES = 4; // sorted pieces a WOLeaf gathers before merging them into its initial run, 0 disables
+const float CONFIG_TOMBSTONE_RATIO = 0.25; // share of removed records at which a WOLeaf rewrites its runs, 0 disables
 #endif // __CONFIG__
@@ -284,7 +284,8 @@ public:
     }
 
     bool upsert(KeyType key, uint64_t value) {
-        idx->update(key, (void *)value);
+        // a store of an existing key replaces its value, in one traversal
+        idx->insert(key, (void *)value);
         return true;
     }
 
@@ -342,7 +343,8 @@ public:
     }
 
     bool upsert(KeyType key, uint64_t value) {
-        idx->update(key, (void *)value);
+        // a store of an existing key replaces its value, in one traversal
+        idx->insert(key, (void *)value);
         return true;
     }
 
@@ -400,7 +402,8 @@ public:
     }
 
     bool upsert(KeyType key, uint64_t value) {
-        idx->update(key, (void *)value);
+        // a store of an existing key replaces its value, in one traversal
+        idx->insert(key, (void *)value);
         return true;
     }
 
@@ -22,10 +22,21 @@ public:
         mt_ = (MorphtreeImpl<NodeType::WOLEAF, true> *) new MorphtreeImpl<NodeType::ROLEAF, true>(initial_recs);
     }
 
+    Morphtree(std::vector<Record> initial_recs, const std::vector<AccessHint> & hints) {
+        // build from initial records, leaf types are chosen by the expected access pattern
+        mt_ = (MorphtreeImpl<NodeType::WOLEAF, true> *) new MorphtreeImpl<NodeType::ROLEAF, true>(initial_recs, hints);
+    }
+
+    Morphtree(std::vector<Record> initial_recs, const std::vector<LeafStats> & leaf_stats) {
+        // build from initial records, leaf types are inherited from a previous run
+        mt_ = (MorphtreeImpl<NodeType::WOLEAF, true> *) new MorphtreeImpl<NodeType::ROLEAF, true>(initial_recs, leaf_stats);
+    }
+
     ~Morphtree() {
         delete mt_;
     }
 
+    // insert a record, or replace the value of an existing key
     inline void insert(_key_t key, _val_t val) {
         mt_->insert(key, val);
     }
@@ -54,6 +65,25 @@ public:
             return nullptr;
     }
 
+    // remove all records in [lo, hi), return the number of records removed
+    inline int delete_range(_key_t lo, _key_t hi) {
+        return mt_->delete_range(lo, hi);
+    }
+
+    // the number of inner nodes on the longest root-to-leaf path
+    inline int max_inner_depth() {
+        return mt_->max_inner_depth();
+    }
+
+    // the bytes of record slots that leaves have freed by dropping removed records and older versions
+    inline uint64_t reclaimed_bytes() {
+        return mt_->reclaimed();
+    }
+
+    inline void dump_stats(std::vector<LeafStats> & out) {
+        mt_->dump_stats(out);
+    }
+
     inline void print() {
         mt_->Print();
     }
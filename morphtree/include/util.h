@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <functional>
+#include <utility>
 
 // default KEYTYPE
 #ifndef KEYTYPE
@@ -100,10 +101,18 @@ public:
         // If floating point precision errors, fit spline
         if (a_ <= 0) {
             a_ = (y_max_ - y_min_) / (x_max_ - x_min_);
-            b_ = -static_cast<double>(x_min_) * a_;
+            b_ = y_min_ - static_cast<double>(x_min_) * a_;
         }
 	}
 
+    // train on the sorted records recs[first, last), whose positions are their targets. 
+    // The same model as add() and build() over them, but trained in doubles with SIMD: 
+    // the mean is taken first, and compensated sums run over the centered keys in separate lanes
+    void build(const Record * recs, int first, int last);
+
+    // train on the n points (xs[i], ys[i]) in any order, in doubles the same way without SIMD
+    void build(const _key_t * xs, const int * ys, int n);
+
     double predict(double x) {
         return x * a_ + b_;
     }
@@ -114,28 +123,105 @@ private:
     long double y_sum_ = 0;
     long double xx_sum_ = 0;
     long double xy_sum_ = 0;
-    _key_t x_min_ = 0;
-    _key_t x_max_ = INT64_MAX;
+    _key_t x_min_ = MAX_KEY;
+    _key_t x_max_ = MIN_KEY;
     double y_min_ = std::numeric_limits<double>::max();
     double y_max_ = std::numeric_limits<double>::lowest();
 };
 
 extern _key_t GetMedian(std::vector<_key_t> & medians);
 
+// sort records by key, records with equal keys keep their order
+extern void SortRecords(Record * recs, int num);
+
+// A loser tree over the heads of k sorted runs, which pops their records in key order 
+// without allocating. Every inner node keeps the loser of the match played there, so a 
+// pop only replays the path of the winning run. Equal keys pop in the order of their runs
+class LoserTree {
+public:
+    static const int MAX_WAYS = 64;
+
+    // merge runs[i][starts[i], ends[i]), starts may be null to merge whole runs
+    LoserTree(Record ** runs, const int * starts, const int * ends, int k);
+
+    inline bool Empty() { return pos_[winner_] >= ends_[winner_]; }
+
+    inline const Record & Top() { return runs_[winner_][pos_[winner_]]; }
+
+    inline void Pop() {
+        int w = winner_;
+        pos_[w] += 1;
+        if(pos_[w] < ends_[w]) keys_[w] = runs_[w][pos_[w]].key;
+        for(int n = (w + ways_) >> 1; n > 0; n >>= 1) {
+            // merged keys come in no predictable order, so the matches are played without branches
+            int l = losers_[n];
+            bool lost = Beats(l, w);
+            losers_[n] = lost ? w : l;
+            w = lost ? l : w;
+        }
+        winner_ = w;
+    }
+
+    // pop all records with the next key, and return the one from the newest run
+    inline Record PopNewest() {
+        Record r = Top();
+        Pop();
+        while(!Empty() && Top().key == r.key) {
+            r = Top();
+            Pop();
+        }
+        return r;
+    }
+
+    // pop up to limit records into out, return the number written. With nodup, only 
+    // the last of the records with equal keys, from the newest run, is written
+    int Drain(Record * out, int limit, bool nodup = false);
+
+private:
+    inline bool Beats(int a, int b) {
+        bool live_a = pos_[a] < ends_[a], live_b = pos_[b] < ends_[b];
+        return live_a & (!live_b | (keys_[a] < keys_[b]) | ((keys_[a] == keys_[b]) & (a < b)));
+    }
+
+    Record ** runs_;
+    int ways_; // k rounded up to a power of two, the missing runs are empty
+    int winner_;
+    int pos_[MAX_WAYS];
+    int ends_[MAX_WAYS];
+    int losers_[MAX_WAYS];
+    _key_t keys_[MAX_WAYS]; // the head key of every live run
+};
+
 extern void TwoWayMerge(Record * a, Record * b, int lena, int lenb, std::vector<Record> & out);
 
+// merge k sorted runs into out, which must hold all of their records. Return the number written
+extern int KWayMerge(Record ** runs, int * run_lens, int k, Record * out);
+
 extern void KWayMerge(Record ** runs, int * run_lens, int k, std::vector<Record> & out);
 
 extern int KWayScan(Record ** runs, int * run_lens, int k, _key_t startKey, int len, Record * out);
 
+// as KWayMerge, but of the records with equal keys only the one from the newest (last) run is written
+extern int KWayMerge_nodup(Record ** runs, int * run_lens, int k, Record * out);
+
 extern void KWayMerge_nodup(Record ** runs, int * run_lens, int k, std::vector<Record> & out);
 
 extern bool BinSearch(Record * recs, int len, _key_t k, _val_t &v);// do binary search
 
+extern int BinSearch_Locate(Record * recs, int len, _key_t k); // the position of k, or of the first larger key
+
 extern bool BinSearch_CallBack(Record * recs, int len, _key_t k, std::function<bool(Record &)> func);
 
 extern bool ExpSearch(Record * recs, int len, int predict, _key_t k, _val_t &v); // do exponential search
 
+extern bool ExpSearch_CallBack(Record * recs, int len, int predict, _key_t k, std::function<bool(Record &)> func);
+
+extern Record * ExpSearch_Find(Record * recs, int len, int predict, _key_t k); // the record of k, or null
+
+// Search k in n non-empty sorted runs at once, return its record in the first run that holds it, or null. 
+// The binary searches advance in lockstep without branches, so their loads overlap in the memory system
+extern Record * LockstepSearch(Record ** runs, int * lens, int n, _key_t k);
+
 extern int getSubOptimalSplitkey(Record * recs, int num);
 
 #endif // __MORPHTREE_UTIL_H__
\ No newline at end of file
@@ -7,22 +7,42 @@ bool do_morphing;
 uint64_t global_stats;
 
 uint32_t rebuild_times;
+uint32_t repair_times;
 uint32_t morph_times;
+uint64_t reclaimed_bytes;
 
 // Predict the node type of a leaf node according to its access history
-void BaseNode::TypeManager(bool isWrite) {
+void BaseNode::TypeManager(_key_t k, bool isWrite) {
     stats = (stats << 1) + (isWrite ? 1 : 0);
     uint8_t one_count = __builtin_popcountl(stats);
     NodeType new_type = (NodeType)node_type;
 
+    // track the heat of the key region, halve all counters before one saturates
+    uint8_t & h = heat[HeatRegion(k)];
+    h += isWrite ? 0x10 : 0x01;
+    if((h & 0xF0) == 0xF0 || (h & 0x0F) == 0x0F) {
+        for(int i = 0; i < HEAT_REGIONS; i++) 
+            heat[i] = (heat[i] >> 1) & 0x77;
+    }
+
+    // the mid-ratio band maps to the buffered RWLeaf, 
+    // the gaps between thresholds avoid morphing back and forth
     switch(node_type) {
         case NodeType::WOLEAF:
-            if(one_count <= 32) 
-                new_type = NodeType::ROLEAF;
+            if(one_count <= 40) 
+                new_type = NodeType::RWLEAF;
             break;
         case NodeType::ROLEAF:
             if(one_count >= 56)
                 new_type = NodeType::WOLEAF;
+            else if(one_count >= 24)
+                new_type = NodeType::RWLEAF;
+            break;
+        case NodeType::RWLEAF:
+            if(one_count >= 56)
+                new_type = NodeType::WOLEAF;
+            else if(one_count <= 8)
+                new_type = NodeType::ROLEAF;
             break;
     }
 
@@ -34,25 +54,47 @@ void BaseNode::TypeManager(bool isWrite) {
 
 // Morph a leaf node from From-type to To-type
 void MorphNode(BaseNode * leaf, NodeType from, NodeType to) {
-    BaseNode * newLeaf;
-    std::vector<Record> tmp;
-    tmp.reserve(GLOBAL_LEAF_SIZE);
-    leaf->Dump(tmp);
+    if(from == NodeType::RWLEAF) {
+        // the buckets of a RWLeaf form a valid ROLeaf once its insert buffer is drained
+        reinterpret_cast<RWLeaf *>(leaf)->Flush();
+        if(to == NodeType::ROLEAF) {
+            leaf->node_type = NodeType::ROLEAF;
+            leaf->stats = ROSTATS;
+            return;
+        }
+        from = NodeType::ROLEAF;
+    }
 
+    // a WOLeaf appends behind its records, so a leaf left full by a Store 
+    // that could not split keeps its type until it splits
+    if(to == NodeType::WOLEAF && reinterpret_cast<ROLeaf *>(leaf)->Count() >= GLOBAL_LEAF_SIZE) 
+        return;
+
+    // convert the leaf directly, without an intermediate copy of its records
+    BaseNode * newLeaf;
     switch(to) {
     case NodeType::ROLEAF:
-        newLeaf = new ROLeaf(tmp.data(), tmp.size());
+        newLeaf = new ROLeaf(reinterpret_cast<WOLeaf *>(leaf));
         break;
     case NodeType::WOLEAF:
-        newLeaf = new WOLeaf(tmp.data(), tmp.size());
+        newLeaf = new WOLeaf(reinterpret_cast<ROLeaf *>(leaf));
+        break;
+    case NodeType::RWLEAF:
+        if(from == NodeType::ROLEAF)
+            newLeaf = new RWLeaf(reinterpret_cast<ROLeaf *>(leaf));
+        else
+            newLeaf = new RWLeaf(reinterpret_cast<WOLeaf *>(leaf));
         break;
     }
     // swap the header of two nodes
+    newLeaf->sibling = leaf->sibling;
+    memcpy(newLeaf->heat, leaf->heat, sizeof(leaf->heat));
     SwapNode(leaf, newLeaf);
 
     switch(from) {
+    case NodeType::RWLEAF: // rewritten to ROLEAF above, its buckets are freed as a ROLeaf
     case NodeType::ROLEAF:
-        delete reinterpret_cast<ROLeaf *>(newLeaf); 
+        delete reinterpret_cast<ROLeaf *>(newLeaf);
         return;
     case NodeType::WOLEAF:
         delete reinterpret_cast<WOLeaf *>(newLeaf);
@@ -62,12 +104,207 @@ void MorphNode(BaseNode * leaf, NodeType from, NodeType to) {
     __builtin_unreachable();
 }
 
+// Leaf types in the order of growing write optimization
+static int WriteRank(NodeType type) {
+    switch(type) {
+    case NodeType::WOLEAF:
+        return 2;
+    case NodeType::RWLEAF:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+bool SweepLeaf(BaseNode * leaf, NodeType phase) {
+    // only consolidate towards read optimization, 
+    // a write phase makes the written leaves morph by themselves
+    NodeType type = (NodeType)leaf->node_type;
+    if(WriteRank(type) <= WriteRank(phase)) 
+        return false;
+
+    bool written = false;
+    for(int i = 0; i < HEAT_REGIONS; i++) 
+        written = written || (leaf->heat[i] & 0xF0) != 0;
+    
+    if(written) { // age the write heat, so that a leaf left idle is morphed on a later visit
+        for(int i = 0; i < HEAT_REGIONS; i++) 
+            leaf->heat[i] = ((leaf->heat[i] >> 1) & 0x70) | (leaf->heat[i] & 0x0F);
+        return true;
+    }
+
+    morph_times += 1;
+    MorphNode(leaf, type, phase);
+    return false;
+}
+
+BaseNode * NewLeaf(NodeType type, Record * recs, int num) {
+    switch(type) {
+    case NodeType::ROLEAF:
+        return num > 0 ? new ROLeaf(recs, num) : new ROLeaf();
+    case NodeType::WOLEAF:
+        return new WOLeaf(recs, num);
+    case NodeType::RWLEAF:
+        return num > 0 ? new RWLeaf(recs, num) : new RWLeaf();
+    default:
+        break;
+    }
+    assert(false);
+    __builtin_unreachable();
+}
+
+// Pick the node type for a given number of writes in the 64-bit statistic, 
+// the bands are within the thresholds of TypeManager so that the node does not morph at once
+NodeType TypeOfStats(int one_count) {
+    if(one_count >= 48)
+        return NodeType::WOLEAF;
+    else if(one_count >= 16)
+        return NodeType::RWLEAF;
+    else 
+        return NodeType::ROLEAF;
+}
+
+// Generate a statistic with one_count writes evenly spread over the history
+uint64_t StatsOf(int one_count) {
+    uint64_t s = 0;
+    for(int i = 0; i < 64; i++) {
+        if((i + 1) * one_count / 64 > i * one_count / 64)
+            s |= 1UL << i;
+    }
+    return s;
+}
+
+uint64_t DefaultStats(NodeType type) {
+    switch(type) {
+    case NodeType::WOLEAF:
+        return WOSTATS;
+    case NodeType::RWLEAF:
+        return RWSTATS;
+    default:
+        return ROSTATS;
+    }
+}
+
+void SplitLeaf(BaseNode * leaf, std::vector<Record> & data, _key_t * split_key, 
+                BaseNode ** left, BaseNode ** right) {
+    static const int COLD_HEAT = 4; // halves with fewer recorded accesses are cold
+    
+    int num = data.size();
+    int pid = getSubOptimalSplitkey(data.data(), num);
+    NodeType types[2] = {(NodeType)leaf->node_type, (NodeType)leaf->node_type};
+    uint64_t stats[2] = {DefaultStats(types[0]), DefaultStats(types[1])};
+
+    if(do_morphing) {
+        // locate the boundaries of heat regions in the records
+        int bound[HEAT_REGIONS + 1];
+        bound[0] = 0, bound[HEAT_REGIONS] = num;
+        for(int r = 1; r < HEAT_REGIONS; r++) {
+            int lo = bound[r - 1], hi = num;
+            while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(leaf->HeatRegion(data[mid].key) < r) lo = mid + 1;
+                else hi = mid;
+            }
+            bound[r] = lo;
+        }
+
+        int reads[HEAT_REGIONS + 1] = {0}, writes[HEAT_REGIONS + 1] = {0}; // prefix sums
+        for(int r = 0; r < HEAT_REGIONS; r++) {
+            reads[r + 1] = reads[r] + (leaf->heat[r] & 0x0F);
+            writes[r + 1] = writes[r] + (leaf->heat[r] >> 4);
+        }
+        
+        // move the split point to the region boundary that best separates
+        // write-hot regions from read-mostly ones, while keeping the halves balanced
+        double best_gap = 0.5;
+        for(int b = 1; b < HEAT_REGIONS; b++) {
+            int lacc = reads[b] + writes[b];
+            int racc = reads[HEAT_REGIONS] - reads[b] + writes[HEAT_REGIONS] - writes[b];
+            if(bound[b] < num / 4 || bound[b] > num * 3 / 4 || lacc + racc < COLD_HEAT)
+                continue;
+
+            double lratio = lacc == 0 ? 0 : (double)writes[b] / lacc;
+            double rratio = racc == 0 ? 0 : (double)(writes[HEAT_REGIONS] - writes[b]) / racc;
+            if(std::abs(lratio - rratio) > best_gap) {
+                best_gap = std::abs(lratio - rratio);
+                pid = bound[b];
+            }
+        }
+
+        // decide the type of each half, a region cut by the split point counts to both
+        int rs = leaf->HeatRegion(data[pid].key);
+        int lr = (bound[rs] == pid ? rs : rs + 1);
+        int side_reads[2] = {reads[lr], reads[HEAT_REGIONS] - reads[rs]};
+        int side_writes[2] = {writes[lr], writes[HEAT_REGIONS] - writes[rs]};
+        for(int i = 0; i < 2; i++) {
+            int acc = side_reads[i] + side_writes[i];
+            if(acc < COLD_HEAT) { // cold data
+                types[i] = NodeType::ROLEAF;
+                stats[i] = ROSTATS;
+            } else {
+                int one_count = (side_writes[i] * 64 + acc / 2) / acc;
+                types[i] = TypeOfStats(one_count);
+                stats[i] = StatsOf(one_count);
+            }
+        }
+    }
+
+    *left = NewLeaf(types[0], data.data(), pid);
+    *right = NewLeaf(types[1], data.data() + pid, num - pid);
+    (*left)->stats = stats[0];
+    (*right)->stats = stats[1];
+    *split_key = data[pid].key;
+}
+
+void MergeLeaf(BaseNode * left, BaseNode * right) {
+    std::vector<Record> data;
+    data.reserve(left->Count() + right->Count());
+    left->Dump(data);
+    right->Dump(data);
+
+    if(data.empty()) { // nothing to move, just unlink the right leaf
+        left->sibling = right->sibling;
+        return;
+    }
+
+    // the left leaf keeps its type and statistic
+    BaseNode * merged = NewLeaf((NodeType)left->node_type, data.data(), data.size());
+    merged->stats = left->stats;
+    merged->sibling = right->sibling;
+
+    SwapNode(left, merged);
+    merged->DeleteNode();
+}
+
+int TrimLeaf(BaseNode * leaf, _key_t lo, _key_t hi) {
+    std::vector<Record> data;
+    data.reserve(leaf->Count());
+    leaf->Dump(data);
+
+    auto first = std::lower_bound(data.begin(), data.end(), lo, 
+                    [](const Record & r, _key_t k) { return r.key < k; });
+    auto last = std::lower_bound(first, data.end(), hi, 
+                    [](const Record & r, _key_t k) { return r.key < k; });
+    int removed = last - first;
+    if(removed == 0) 
+        return 0;
+    data.erase(first, last);
+
+    BaseNode * trimmed = NewLeaf((NodeType)leaf->node_type, data.data(), data.size());
+    trimmed->stats = leaf->stats;
+    trimmed->sibling = leaf->sibling;
+
+    SwapNode(leaf, trimmed);
+    trimmed->DeleteNode();
+    return removed;
+}
+
 bool BaseNode::Store(_key_t k, _val_t v, _key_t * split_key, BaseNode ** split_node) {
     if(!Leaf()) {
         return reinterpret_cast<ROInner *>(this)->Store(k, v, split_key, (ROInner **)split_node);
     } else {
         if(do_morphing) {
-            TypeManager(true);
+            TypeManager(k, true);
         }
 
         switch(node_type) {
@@ -75,6 +312,8 @@ bool BaseNode::Store(_key_t k, _val_t v, _key_t * split_key, BaseNode ** split_n
             return reinterpret_cast<ROLeaf *>(this)->Store(k, v, split_key, (ROLeaf **)split_node);
         case NodeType::WOLEAF:
             return reinterpret_cast<WOLeaf *>(this)->Store(k, v, split_key, (WOLeaf **)split_node);
+        case NodeType::RWLEAF:
+            return reinterpret_cast<RWLeaf *>(this)->Store(k, v, split_key, (RWLeaf **)split_node);
         }
         assert(false);
         __builtin_unreachable();
@@ -87,7 +326,7 @@ bool BaseNode::Lookup(_key_t k, _val_t & v) {
         return true;
     } else {
         if(do_morphing) {
-            TypeManager(false);
+            TypeManager(k, false);
         }
         
         switch(node_type) {
@@ -95,6 +334,8 @@ bool BaseNode::Lookup(_key_t k, _val_t & v) {
             return reinterpret_cast<ROLeaf *>(this)->Lookup(k, v);
         case NodeType::WOLEAF:
             return reinterpret_cast<WOLeaf *>(this)->Lookup(k, v);
+        case NodeType::RWLEAF:
+            return reinterpret_cast<RWLeaf *>(this)->Lookup(k, v);
         }
         assert(false);
         __builtin_unreachable();
@@ -111,6 +352,8 @@ void BaseNode::Print(string prefix) {
             return reinterpret_cast<ROLeaf *>(this)->Print(prefix);
         case NodeType::WOLEAF:
             return reinterpret_cast<WOLeaf *>(this)->Print(prefix);
+        case NodeType::RWLEAF:
+            return reinterpret_cast<RWLeaf *>(this)->Print(prefix);
         }
         assert(false);
         __builtin_unreachable();
@@ -119,13 +362,15 @@ void BaseNode::Print(string prefix) {
 
 bool BaseNode::Update(const _key_t & k, _val_t v) {
     if(do_morphing) {
-        TypeManager(false);
+        TypeManager(k, false);
     }
     switch(node_type) {
     case NodeType::ROLEAF: 
         return reinterpret_cast<ROLeaf *>(this)->Update(k, v);
     case NodeType::WOLEAF:
         return reinterpret_cast<WOLeaf *>(this)->Update(k, v);
+    case NodeType::RWLEAF:
+        return reinterpret_cast<RWLeaf *>(this)->Update(k, v);
     }
     assert(false);
     __builtin_unreachable();
@@ -133,13 +378,15 @@ bool BaseNode::Update(const _key_t & k, _val_t v) {
 
 bool BaseNode::Remove(const _key_t & k) {
     if(do_morphing) {
-        TypeManager(true);
+        TypeManager(k, true);
     }
     switch(node_type) {
     case NodeType::ROLEAF: 
         return reinterpret_cast<ROLeaf *>(this)->Remove(k);
     case NodeType::WOLEAF:
         return reinterpret_cast<WOLeaf *>(this)->Remove(k);
+    case NodeType::RWLEAF:
+        return reinterpret_cast<RWLeaf *>(this)->Remove(k);
     }
     assert(false);
     __builtin_unreachable();
@@ -147,13 +394,15 @@ bool BaseNode::Remove(const _key_t & k) {
 
 int BaseNode::Scan(const _key_t &startKey, int len, Record *result) {
     if(do_morphing) {
-        TypeManager(false);
+        TypeManager(startKey, false);
     }
     switch(node_type) {
     case NodeType::ROLEAF: 
         return reinterpret_cast<ROLeaf *>(this)->Scan(startKey, len, result);
     case NodeType::WOLEAF:
         return reinterpret_cast<WOLeaf *>(this)->Scan(startKey, len, result);
+    case NodeType::RWLEAF:
+        return reinterpret_cast<RWLeaf *>(this)->Scan(startKey, len, result);
     }
     assert(false);
     __builtin_unreachable();
@@ -167,7 +416,34 @@ void BaseNode::Dump(std::vector<Record> & out) {
     case NodeType::WOLEAF:
         reinterpret_cast<WOLeaf *>(this)->Dump(out);
         break;
+    case NodeType::RWLEAF:
+        reinterpret_cast<RWLeaf *>(this)->Dump(out);
+        break;
+    }
+}
+
+int BaseNode::Count() {
+    switch(node_type) {
+    case NodeType::ROLEAF: 
+        return reinterpret_cast<ROLeaf *>(this)->Count();
+    case NodeType::WOLEAF:
+        return reinterpret_cast<WOLeaf *>(this)->Count();
+    case NodeType::RWLEAF:
+        return reinterpret_cast<RWLeaf *>(this)->Count();
+    }
+    assert(false);
+    __builtin_unreachable();
+}
+
+int BaseNode::HeatRegion(_key_t k) {
+    switch(node_type) {
+    case NodeType::ROLEAF: 
+    case NodeType::RWLEAF:
+        return reinterpret_cast<ROLeaf *>(this)->HeatRegion(k);
+    case NodeType::WOLEAF:
+        return reinterpret_cast<WOLeaf *>(this)->HeatRegion(k);
     }
+    return 0;
 }
 
 void BaseNode::DeleteNode() {
@@ -181,6 +457,9 @@ void BaseNode::DeleteNode() {
         case NodeType::WOLEAF:
             delete reinterpret_cast<WOLeaf *>(this);
             break;
+        case NodeType::RWLEAF:
+            delete reinterpret_cast<RWLeaf *>(this);
+            break;
     }
     return ;
 }
@@ -1,10 +1,30 @@
 #ifndef __MORPHTREE_IMPL_H__
 #define __MORPHTREE_IMPL_H__
 
+#include <type_traits>
+
 #include "node.h"
 
 namespace morphtree {
 
+// The expected access pattern of the key range starting from start, 
+// the ratios are relative to each other and need not sum to one
+struct AccessHint {
+    _key_t start;
+    float read;
+    float write;
+    float scan;
+};
+
+// The statistic of a leaf node, dumped by a running tree to warm up a later bulkload
+struct LeafStats {
+    _key_t start; // the smallest key routed to the leaf
+    uint8_t node_type;
+    uint64_t stats;
+    int runs = 1; // sorted runs a lookup in the leaf may search, more than one only in WOLeaf
+    int tombstones = 0; // removed records the leaf still holds, only in WOLeaf
+};
+
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF = false>
 class MorphtreeImpl {
 public:
@@ -12,27 +32,111 @@ public:
 
     explicit MorphtreeImpl(std::vector<Record> & initial_recs);
 
+    MorphtreeImpl(std::vector<Record> & initial_recs, const std::vector<AccessHint> & hints);
+
+    MorphtreeImpl(std::vector<Record> & initial_recs, const std::vector<LeafStats> & leaf_stats);
+
     ~MorphtreeImpl();
  
+    // insert or upsert, the newest value of a key wins
     void insert(const _key_t & key, const _val_t val);
 
     bool update(const _key_t & key, const _val_t val);
 
     bool remove(const _key_t & key);
 
+    // remove all records in [lo, hi), return the number of records removed
+    int delete_range(const _key_t & lo, const _key_t & hi);
+
     bool lookup(const _key_t & key, _val_t & v);
 
     int scan(const _key_t &startKey, int range, Record *result);
 
     void Print();
 
+    // the number of inner nodes on the longest root-to-leaf path, overflow nodes included
+    int max_inner_depth();
+
+    // the bytes of record slots that leaves have freed by dropping removed records and older versions
+    inline uint64_t reclaimed() { return reclaimed_bytes; }
+
     void bulkload(std::vector<Record> & initial_recs);
+
+    // bulkload with leaf types chosen by the expected access pattern, hints are sorted by start
+    void bulkload(std::vector<Record> & initial_recs, const std::vector<AccessHint> & hints);
+
+    // bulkload with leaf types and statistics inherited from a previous dump_stats
+    void bulkload(std::vector<Record> & initial_recs, const std::vector<LeafStats> & leaf_stats);
+
+    // dump the type and statistic of all leaf nodes in key order
+    void dump_stats(std::vector<LeafStats> & out);
+
+    // dump the prediction error of all inner nodes, recount rebuilds it from the buckets first
+    void dump_errors(std::vector<InnerError> & out, bool recount = false);
     
 private:
-    bool insert_recursive(BaseNode * n, const _key_t & key, const _val_t val, 
-                                _key_t * split_k, BaseNode ** split_n);
+    static const int MAX_PATH = 64; // inner nodes on a root-to-leaf path, overflow nodes included
+
+    // pick(start, type, stats) decides the type and statistic of a leaf starting at start
+    template<typename Picker>
+    void bulkload_with(std::vector<Record> & initial_recs, Picker pick);
+
+    void dump_stats_recursive(BaseNode * n, _key_t start, std::vector<LeafStats> & out);
+
+    // merge an underflowed leaf routing key with its right or left sibling, and drop the index record 
+    // of the leaf merged away
+    void merge_leaf(BaseNode * leaf, const _key_t & key);
+
+    // remove the index record sep of a merged leaf, and bring the root snapshots up to date
+    void drop_separator(const _key_t & sep);
+
+    // the leaf routing key, and the key of its index record
+    BaseNode * find_leaf(const _key_t & key, _key_t & sep);
+
+    // the largest key less than k
+    static inline _key_t prev_key(const _key_t & k) {
+        if constexpr (std::is_floating_point<_key_t>::value) 
+            return std::nextafter(k, MIN_KEY);
+        else 
+            return k - 1;
+    }
+
+    // sample the operation mix into global_stats, and sweep idle leaves when the global phase shifts
+    void phase_tick(bool isWrite);
+
+    BaseNode * leftmost_leaf();
+
+    // where reads start from: the flattened snapshot of the upper levels if there is one
+    inline BaseNode * top() {
+        return flat_.Empty() ? root_ : flat_.Root();
+    }
+
+    // route a key through an inner node, the root is served by the radix table if there is one
+    inline void route(BaseNode * n, const _key_t & key, _val_t & v) {
+        if((n == root_ || n == top()) && !table_.Empty())
+            table_.Lookup(reinterpret_cast<ROInner *>(n), key, v);
+        else 
+            n->Lookup(key, v);
+    }
+
+    // the slot of an inner node routing key
+    inline int route_slot(ROInner * n, const _key_t & key) {
+        if(n == root_ && !table_.Empty())
+            return table_.Slot(n, key);
+        else 
+            return n->Slot(key);
+    }
 
     BaseNode * root_;
+    RadixTable table_;
+    FlatInner flat_;
+
+    // workload phase detection
+    uint32_t op_count_ = 0;
+    uint32_t write_count_ = 0;
+    NodeType phase_ = INIT_LEAF_TYPE;
+    BaseNode * sweep_cur_ = nullptr; // the next leaf to sweep, nullptr if no sweep is running
+    bool sweep_pending_ = false;     // a leaf of the current sweep pass needs another visit
 };
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
@@ -46,25 +150,61 @@ MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::MorphtreeImpl() {
         root_ = new WOLeaf();
         global_stats = WOSTATS;
         break;
+    case NodeType::RWLEAF:
+        root_ = new RWLeaf();
+        global_stats = RWSTATS;
+        break;
     }
 
     // global variables assignment
     do_morphing = MORPH_IF;
-    global_stats = 0;
     rebuild_times = 0;
+    repair_times = 0;
     morph_times = 0;
+    reclaimed_bytes = 0;
 }
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::MorphtreeImpl(std::vector<Record> & initial_recs) {
     // global variables assignment
     do_morphing = MORPH_IF;
+    global_stats = DefaultStats(INIT_LEAF_TYPE);
     rebuild_times = 0;
+    repair_times = 0;
     morph_times = 0;
+    reclaimed_bytes = 0;
 
     bulkload(initial_recs);
 }
 
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::MorphtreeImpl(std::vector<Record> & initial_recs, 
+                                                        const std::vector<AccessHint> & hints) {
+    // global variables assignment
+    do_morphing = MORPH_IF;
+    global_stats = DefaultStats(INIT_LEAF_TYPE);
+    rebuild_times = 0;
+    repair_times = 0;
+    morph_times = 0;
+    reclaimed_bytes = 0;
+
+    bulkload(initial_recs, hints);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::MorphtreeImpl(std::vector<Record> & initial_recs, 
+                                                        const std::vector<LeafStats> & leaf_stats) {
+    // global variables assignment
+    do_morphing = MORPH_IF;
+    global_stats = DefaultStats(INIT_LEAF_TYPE);
+    rebuild_times = 0;
+    repair_times = 0;
+    morph_times = 0;
+    reclaimed_bytes = 0;
+
+    bulkload(initial_recs, leaf_stats);
+}
+
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::~MorphtreeImpl() {
     delete root_;
@@ -73,11 +213,13 @@ MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::~MorphtreeImpl() {
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 bool MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::lookup(const _key_t &key, _val_t & val) {
-    BaseNode * cur = root_;
+    if(MORPH_IF) phase_tick(false);
+
+    BaseNode * cur = top();
 
     _val_t v;
     while(!cur->Leaf()) {
-        cur->Lookup(key, v);
+        route(cur, key, v);
         cur = (BaseNode *) v;
     }
 
@@ -86,52 +228,75 @@ bool MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::lookup(const _key_t &key, _val_t &
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::insert(const _key_t &key, _val_t val) {
+    if(MORPH_IF) phase_tick(true);
+
+    // descend from the root, remembering the inner nodes and the slots that routed key
+    ROInner * path[MAX_PATH];
+    int slots[MAX_PATH];
+    int height = 0;
+
+    BaseNode * cur = root_;
+    while(!cur->Leaf()) {
+        assert(height < MAX_PATH);
+        ROInner * inner = reinterpret_cast<ROInner *>(cur);
+        path[height] = inner;
+        slots[height] = route_slot(inner, key);
+        cur = (BaseNode *) inner->recs[slots[height]].val;
+        height += 1;
+    }
+
     _key_t split_k;
     BaseNode * split_node;
-    bool splitIf = insert_recursive(root_, key, val, &split_k, &split_node);
+    bool splitIf = cur->Store(key, val, &split_k, &split_node);
+
+    // propagate the split upwards, the slot that routed key tells where the new separator goes
+    while(splitIf && height > 0) {
+        ROInner * parent = path[--height];
+        _key_t child_k = split_k;
+
+        uint32_t relayouts = rebuild_times + repair_times;
+        splitIf = parent->Store(child_k, split_node, &split_k, (ROInner **)&split_node, slots[height]);
+
+        // the segments of the root only change when an inner node is re-laid out, 
+        // otherwise the snapshot only needs the root bucket routing the new key
+        bool relayout = (rebuild_times + repair_times != relayouts);
+        if(table_.Empty() || relayout) 
+            table_.Build(root_);
+
+        if(relayout) 
+            flat_.Build(root_);
+        else 
+            flat_.Patch(root_, child_k);
+    }
     
     if(splitIf) {
         Record tmp[2] = {Record(MIN_KEY, root_), Record(split_k, split_node)};
         ROInner * newroot = new ROInner(tmp, 2);
         root_ = newroot;
+        table_.Build(root_);
+        flat_.Build(root_);
     }
 }
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
-bool MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::insert_recursive(BaseNode * n, const _key_t & key, const _val_t val, 
-                                    _key_t * split_k, BaseNode ** split_n) {
-    if(n->Leaf()) {
-        return n->Store(key, val, split_k, split_n);
-    } else {
-        _val_t v; n->Lookup(key, v);
-        BaseNode * child = (BaseNode *) v;
-
-        _key_t split_k_child;
-        BaseNode * split_n_child;
-        bool splitIf = insert_recursive(child, key, val, &split_k_child, &split_n_child);
-
-        if(splitIf) {
-            bool found = n->Store(split_k_child, split_n_child, split_k, split_n);
-
-            return found;
-        } else {
-            return false;
-        }
-    }
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::Print() {
+    root_->Print(string(""));
 }
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
-void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::Print() {
-    root_->Print(string(""));
+int MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::max_inner_depth() {
+    return root_->Leaf() ? 0 : ((ROInner *)root_)->Depth();
 }
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 bool MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::update(const _key_t & key, const _val_t val) {
-    BaseNode * cur = root_;
+    if(MORPH_IF) phase_tick(true);
+
+    BaseNode * cur = top();
 
     _val_t v;
     while(!cur->Leaf()) {
-        cur->Lookup(key, v);
+        route(cur, key, v);
         cur = (BaseNode *) v;
     }
 
@@ -140,25 +305,156 @@ bool MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::update(const _key_t & key, const _
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 bool MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::remove(const _key_t & key) {
-    BaseNode * cur = root_;
+    if(MORPH_IF) phase_tick(true);
+
+    BaseNode * cur = top();
 
     _val_t v;
     while(!cur->Leaf()) {
-        cur->Lookup(key, v);
+        route(cur, key, v);
         cur = (BaseNode *) v;
     }
 
-    return cur->Remove(key);
+    if(!cur->Remove(key)) 
+        return false;
+
+    if(cur->Count() < UNDERFLOW_SIZE && !root_->Leaf()) 
+        merge_leaf(cur, key);
+    return true;
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+int MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::delete_range(const _key_t & lo, const _key_t & hi) {
+    if(MORPH_IF) phase_tick(true);
+    if(hi <= lo) 
+        return 0;
+    if(root_->Leaf()) 
+        return TrimLeaf(root_, lo, hi);
+
+    // the leaves strictly between the two boundary leaves are covered by the range
+    _key_t lo_sep, hi_sep;
+    BaseNode * first = find_leaf(lo, lo_sep);
+    BaseNode * last = find_leaf(prev_key(hi), hi_sep);
+
+    int removed = 0;
+    if(first != last) {
+        // drop their index records at once, the inner nodes still peek at the leaves meanwhile
+        ROInner * root = reinterpret_cast<ROInner *>(root_);
+        root->RemoveRange(lo_sep, hi_sep);
+        table_.Build(root_);
+        flat_.Build(root_);
+
+        // Count() is only an upper bound in WOLeaf and RWLeaf, the dropped records are counted from a dump
+        std::vector<Record> dropped;
+        for(BaseNode * cur = first->sibling; cur != last; ) {
+            BaseNode * next = cur->sibling;
+            dropped.clear();
+            cur->Dump(dropped);
+            removed += dropped.size();
+            if(sweep_cur_ == cur) 
+                sweep_cur_ = first;
+            cur->DeleteNode();
+            cur = next;
+        }
+        first->sibling = last;
+    }
+
+    removed += TrimLeaf(first, lo, hi);
+    if(first != last) 
+        removed += TrimLeaf(last, lo, hi);
+
+    // the boundary leaves may have underflowed
+    if(first != last && last->Count() < UNDERFLOW_SIZE) 
+        merge_leaf(last, hi_sep);
+    if(first->Count() < UNDERFLOW_SIZE && !root_->Leaf()) 
+        merge_leaf(first, lo);
+    return removed;
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::merge_leaf(BaseNode * leaf, const _key_t & key) {
+    // the right sibling is at hand through the sibling link. Its separator is looked up by its 
+    // first key only once the two fit together, so an empty right sibling is left to the left merge
+    BaseNode * right = leaf->sibling;
+    Record first;
+    if(right != nullptr && right->Count() > 0 && leaf->Count() + right->Count() <= MERGE_SIZE 
+        && right->Scan(key, 1, &first) == 1) {
+        _key_t right_sep;
+        if(find_leaf(first.key, right_sep) == right) {
+            MergeLeaf(leaf, right);
+            if(sweep_cur_ == right) 
+                sweep_cur_ = leaf;
+            drop_separator(right_sep); // the inner nodes still peek at the leaf meanwhile
+            right->DeleteNode();
+            return;
+        }
+    }
+
+    _key_t sep;
+    find_leaf(key, sep);
+    if(sep == MIN_KEY) // the leftmost leaf has no left sibling
+        return;
+
+    // the left sibling covers the keys right before the separator
+    _key_t left_sep;
+    BaseNode * left = find_leaf(prev_key(sep), left_sep);
+    if(left->sibling != leaf || left->Count() + leaf->Count() > MERGE_SIZE) 
+        return;
+
+    MergeLeaf(left, leaf);
+    if(sweep_cur_ == leaf) 
+        sweep_cur_ = left;
+    drop_separator(sep);
+    leaf->DeleteNode();
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::drop_separator(const _key_t & sep) {
+    // removals are retrained in batches: the inner node only rebuilds once it is half empty
+    ROInner * root = reinterpret_cast<ROInner *>(root_);
+    uint32_t relayouts = rebuild_times + repair_times;
+    root->Remove(sep);
+    if(root->count == 1) { // a single leaf is left
+        root_ = (BaseNode *) root->recs[0].val;
+        delete root;
+        table_.Build(root_);
+        flat_.Build(root_);
+        return;
+    }
+
+    // as on insert, the snapshots are only rebuilt when an inner node is re-laid out
+    bool relayout = (rebuild_times + repair_times != relayouts);
+    if(table_.Empty() || relayout) 
+        table_.Build(root_);
+
+    if(relayout) 
+        flat_.Build(root_);
+    else 
+        flat_.Patch(root_, sep);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+BaseNode * MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::find_leaf(const _key_t & key, _key_t & sep) {
+    BaseNode * cur = root_;
+    sep = MIN_KEY;
+    while(!cur->Leaf()) {
+        Record * r = reinterpret_cast<ROInner *>(cur)->Route(key);
+        sep = r->key;
+        cur = (BaseNode *) r->val;
+    }
+    return cur;
 }
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 int MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::scan(const _key_t &startKey, int len, Record *result) {
+    if(MORPH_IF) phase_tick(false);
+
     // the user is reponsible for reserve enough space for saving result
-    BaseNode * cur = root_;
+    BaseNode * cur = top();
 
     _val_t v;
     while(!cur->Leaf()) {
-        cur->Lookup(startKey, v);
+        route(cur, startKey, v);
         cur = (BaseNode *) v;
     }
 
@@ -167,43 +463,86 @@ int MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::scan(const _key_t &startKey, int le
 
 template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
 void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::bulkload(std::vector<Record> & initial_recs) {
-    int leafnode_num = (initial_recs.size() / GLOBAL_LEAF_SIZE) * 2 +
-                        (initial_recs.size() % GLOBAL_LEAF_SIZE > 0 ? 1 : 0) * 2;
+    auto pick = [](_key_t, NodeType & type, uint64_t & stats) {
+        type = INIT_LEAF_TYPE;
+        stats = DefaultStats(INIT_LEAF_TYPE);
+    };
+
+    bulkload_with(initial_recs, pick);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::bulkload(std::vector<Record> & initial_recs, 
+                                                        const std::vector<AccessHint> & hints) {
+    auto pick = [&hints](_key_t start, NodeType & type, uint64_t & stats) {
+        type = INIT_LEAF_TYPE;
+        stats = DefaultStats(INIT_LEAF_TYPE);
+
+        // find the last hint starting no later than the leaf
+        auto it = std::upper_bound(hints.begin(), hints.end(), start, 
+                    [](_key_t k, const AccessHint & h) { return k < h.start; });
+        if(it == hints.begin()) return;
+        const AccessHint & h = *(it - 1);
+        
+        float total = h.read + h.write + h.scan;
+        if(total <= 0) return;
+
+        // scans are served like reads, so only writes count as ones in the statistic
+        int one_count = std::min(64, std::max(0, (int)std::lround(64 * h.write / total)));
+        stats = StatsOf(one_count);
+        if(MORPH_IF) type = TypeOfStats(one_count);
+    };
+
+    bulkload_with(initial_recs, pick);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::bulkload(std::vector<Record> & initial_recs, 
+                                                        const std::vector<LeafStats> & leaf_stats) {
+    auto pick = [&leaf_stats](_key_t start, NodeType & type, uint64_t & stats) {
+        type = INIT_LEAF_TYPE;
+        stats = DefaultStats(INIT_LEAF_TYPE);
+
+        // the dumped leaf covering the start of the new leaf
+        auto it = std::upper_bound(leaf_stats.begin(), leaf_stats.end(), start, 
+                    [](_key_t k, const LeafStats & l) { return k < l.start; });
+        if(it == leaf_stats.begin()) return;
+        const LeafStats & l = *(it - 1);
+
+        stats = l.stats;
+        if(MORPH_IF) type = (NodeType) l.node_type;
+    };
+
+    bulkload_with(initial_recs, pick);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+template<typename Picker>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::bulkload_with(std::vector<Record> & initial_recs, Picker pick) {
     int total_num = initial_recs.size();
+    int chunk_num = (total_num + GLOBAL_LEAF_SIZE - 1) / GLOBAL_LEAF_SIZE;
+    int leafnode_num = chunk_num * 2;
     Record * index_record = new Record[leafnode_num];
-    int i = 0;
-    BaseNode *l1, *l2;
-    for(; i < initial_recs.size() / GLOBAL_LEAF_SIZE; i++) {
-        Record * base = initial_recs.data() + i * GLOBAL_LEAF_SIZE;
-        int split_pos = getSubOptimalSplitkey(base, GLOBAL_LEAF_SIZE);
-        
-        if(INIT_LEAF_TYPE == NodeType::ROLEAF) {
-            l1 = new ROLeaf(base, split_pos);
-            l2 = new ROLeaf(base + split_pos, GLOBAL_LEAF_SIZE - split_pos);
-        } else {
-            l1 = new WOLeaf(base, split_pos);
-            l2 = new WOLeaf(base + split_pos, GLOBAL_LEAF_SIZE - split_pos);
-        }
 
-        index_record[i * 2].key = (i == 0 ? MIN_KEY : base[0].key);
-        index_record[i * 2].val = _val_t(l1);
-        index_record[i * 2 + 1].key = base[split_pos].key;
-        index_record[i * 2 + 1].val = _val_t(l2);
-    }
+    auto new_leaf = [&pick](Record * recs, int num) {
+        NodeType type;
+        uint64_t stats;
+        pick(recs[0].key, type, stats);
 
-    if(initial_recs.size() % GLOBAL_LEAF_SIZE > 0) {
-        int total = initial_recs.size() - i * GLOBAL_LEAF_SIZE; 
+        BaseNode * leaf = NewLeaf(type, recs, num);
+        leaf->stats = stats;
+        return leaf;
+    };
+
+    for(int i = 0; i < chunk_num; i++) {
         Record * base = initial_recs.data() + i * GLOBAL_LEAF_SIZE;
+        int total = std::min(GLOBAL_LEAF_SIZE, total_num - i * GLOBAL_LEAF_SIZE);
         int split_pos = getSubOptimalSplitkey(base, total);
-        if(INIT_LEAF_TYPE == NodeType::ROLEAF) {
-            l1 = new ROLeaf(base, split_pos);
-            l2 = new ROLeaf(base + split_pos, total - split_pos);
-        } else {
-            l1 = new WOLeaf(base, split_pos);
-            l2 = new WOLeaf(base + split_pos, total - split_pos);
-        }
-        
-        index_record[i * 2].key = base[0].key;
+
+        BaseNode * l1 = new_leaf(base, split_pos);
+        BaseNode * l2 = new_leaf(base + split_pos, total - split_pos);
+
+        index_record[i * 2].key = (i == 0 ? MIN_KEY : base[0].key);
         index_record[i * 2].val = _val_t(l1);
         index_record[i * 2 + 1].key = base[split_pos].key;
         index_record[i * 2 + 1].val = _val_t(l2);
@@ -220,9 +559,92 @@ void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::bulkload(std::vector<Record> & ini
     cur->sibling = nullptr;
 
     root_ = new ROInner(index_record, leafnode_num);
+    table_.Build(root_);
+    flat_.Build(root_);
     delete [] index_record;
 }
 
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::dump_stats(std::vector<LeafStats> & out) {
+    dump_stats_recursive(root_, MIN_KEY, out);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::dump_errors(std::vector<InnerError> & out, bool recount) {
+    if(!root_->Leaf()) 
+        reinterpret_cast<ROInner *>(root_)->DumpError(out, recount);
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::dump_stats_recursive(BaseNode * n, _key_t start, 
+                                                                    std::vector<LeafStats> & out) {
+    if(n->Leaf()) {
+        bool wo = n->node_type == WOLEAF;
+        int runs = wo ? reinterpret_cast<WOLeaf *>(n)->RunCount() : 1;
+        int tombstones = wo ? reinterpret_cast<WOLeaf *>(n)->Tombstones() : 0;
+        out.push_back({start, n->node_type, n->stats, runs, tombstones});
+    } else {
+        std::vector<Record> children;
+        reinterpret_cast<ROInner *>(n)->Dump(children);
+        for(int i = 0; i < children.size(); i++) {
+            // the first child inherits the range start of its parent
+            _key_t child_start = (i == 0 ? start : children[i].key);
+            dump_stats_recursive((BaseNode *) children[i].val, child_start, out);
+        }
+    }
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+void MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::phase_tick(bool isWrite) {
+    write_count_ += isWrite ? 1 : 0;
+    op_count_ += 1;
+
+    if(op_count_ == PHASE_EPOCH) {
+        // each bit of global_stats tells whether writes dominate an epoch
+        global_stats = (global_stats << 1) + (write_count_ * 2 > op_count_ ? 1 : 0);
+        op_count_ = 0;
+        write_count_ = 0;
+
+        // the gaps between the bands avoid flipping the phase back and forth
+        int one_count = __builtin_popcountl(global_stats & ((1UL << PHASE_WINDOW) - 1));
+        NodeType new_phase = phase_;
+        if(one_count >= PHASE_WINDOW - 1)
+            new_phase = NodeType::WOLEAF;
+        else if(one_count <= 1)
+            new_phase = NodeType::ROLEAF;
+        else if(one_count >= 3 && one_count <= PHASE_WINDOW - 3)
+            new_phase = NodeType::RWLEAF;
+
+        if(new_phase != phase_) { // start a new sweep from the leftmost leaf
+            phase_ = new_phase;
+            sweep_cur_ = (phase_ == NodeType::WOLEAF ? nullptr : leftmost_leaf());
+            sweep_pending_ = false;
+        }
+    } else if(sweep_cur_ != nullptr && op_count_ % SWEEP_INTERVAL == 0) {
+        // the sweep is amortized over foreground operations, one leaf at a time
+        sweep_pending_ = SweepLeaf(sweep_cur_, phase_) || sweep_pending_;
+        sweep_cur_ = sweep_cur_->sibling;
+
+        if(sweep_cur_ == nullptr && sweep_pending_) { // revisit the leaves still being written
+            sweep_cur_ = leftmost_leaf();
+            sweep_pending_ = false;
+        }
+    }
+}
+
+template<NodeType INIT_LEAF_TYPE, bool MORPH_IF>
+BaseNode * MorphtreeImpl<INIT_LEAF_TYPE, MORPH_IF>::leftmost_leaf() {
+    BaseNode * cur = root_;
+
+    _val_t v;
+    while(!cur->Leaf()) {
+        cur->Lookup(MIN_KEY, v);
+        cur = (BaseNode *) v;
+    }
+
+    return cur;
+}
+
 } // namespace morphtree
 
 #endif // __MORPHTREE_IMPL_H__
\ No newline at end of file
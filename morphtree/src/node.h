@@ -18,12 +18,21 @@
 namespace morphtree {
 using std::string;
 // Node types: all non-leaf nodes are of type ROLEAF
-enum NodeType {ROINNER = 0, ROLEAF, WOLEAF};
+enum NodeType {ROINNER = 0, ROLEAF, WOLEAF, RWLEAF};
 
 // hyper parameters of Morphtree
 const uint64_t ROSTATS = 0x0000000000000000; // default statistic of RONode
 const uint64_t WOSTATS = 0xFFFFFFFFFFFFFFFF; // default statistic of WONode
+const uint64_t RWSTATS = 0x5555555555555555; // default statistic of RWNode
 const int GLOBAL_LEAF_SIZE   = CONFIG_NODESIZE;    // the maximum node size of a leaf node
+const int HEAT_REGIONS       = 6;                  // number of key regions whose access heat a leaf tracks
+const int PHASE_EPOCH        = 1024;               // operations sampled into one bit of global_stats
+const int PHASE_WINDOW       = 8;                  // number of recent epochs deciding the global phase
+const int SWEEP_INTERVAL     = 16;                 // operations between two steps of a leaf sweep
+const int RADIX_BITS         = CONFIG_RADIX_BITS;  // log2 of the maximum number of radix table cells
+const int FLAT_LEVELS        = CONFIG_FLAT_LEVELS; // number of upper inner levels kept in a flattened snapshot
+const int UNDERFLOW_SIZE     = GLOBAL_LEAF_SIZE / 8; // leaves with fewer live records merge with a sibling
+const int MERGE_SIZE         = GLOBAL_LEAF_SIZE / 2; // the most live records a merged leaf starts with
 
 // We do NOT use virtual function here, 
 // as it brings extra overhead of searching virtual table
@@ -33,7 +42,10 @@ public:
     
     void DeleteNode();
 
-    void TypeManager(bool isWrite);
+    void TypeManager(_key_t k, bool isWrite);
+
+    // map a key to one of the HEAT_REGIONS regions of a leaf node
+    int HeatRegion(_key_t k);
 
 public:
     bool Store(_key_t k, _val_t v, _key_t * split_key, BaseNode ** split_node);
@@ -48,6 +60,10 @@ public:
 
     void Dump(std::vector<Record> & out);
 
+    // the number of records in a leaf node, an upper bound in WOLeaf and RWLeaf 
+    // as they may still hold older versions, removed records or buffered upserts
+    int Count();
+
     inline bool Leaf() { return node_type != ROINNER; }
 
     void Print(string prefix);
@@ -56,13 +72,22 @@ public:
     // Node header
     uint8_t node_type;
     uint8_t lock;
-    char padding[6];
+    uint8_t heat[HEAT_REGIONS]; // access heat of leaf regions: writes in high 4 bits, reads in low 4 bits
     uint64_t stats;
     BaseNode * sibling;
 };
 
+// The prediction error of an inner node, counted in buckets walked to recover from a misprediction
+struct InnerError {
+    int max_err;
+    double avg_err;
+};
+
 // Inner node structures
 class ROInner : public BaseNode {
+    friend class RadixTable;
+    friend class FlatInner;
+
 public:
     ROInner() = delete;
 
@@ -70,43 +95,259 @@ public:
 
     ~ROInner();
 
-    void Clear() {capacity = 0;}
+    void Clear() {
+        if(seg_num > 0) delete [] Segments();
+        seg_num = 0;
+        capacity = 0;
+    }
 
-    bool Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_node);
+    // slot is the slot that routed k on the way down, if the caller has it, -1 otherwise
+    bool Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_node, int slot = -1);
 
     bool Lookup(_key_t k, _val_t &v);
 
+    // the slot routing k in this node, which may point to an overflow inner node
+    int Slot(_key_t k);
+
+    // remove the index record of key k, return false if there is none
+    bool Remove(const _key_t & k);
+
+    // the index record routing k, which may reside in an overflow inner node, 
+    // depth tells the number of inner nodes passed through, this one included
+    Record * Route(_key_t k, int * depth = nullptr);
+
+    // remove the index records with keys in (lo, hi) by one local re-layout, return the number removed
+    int RemoveRange(_key_t lo, _key_t hi);
+
     void Print(string prefix);
 
+    // gather the index records, including those in overflow inner nodes
+    void Dump(std::vector<Record> & out);
+
+    // gather the prediction error of this node and all inner nodes below it, 
+    // recount rebuilds the error of each node first, which tightens max_err
+    void DumpError(std::vector<InnerError> & out, bool recount = false);
+
+    // the number of inner nodes on the longest path from this node down to a leaf
+    int Depth();
+
 private:
+    // a linear piece of the model for keys from start, covering the slots [first, first of the next segment)
+    struct Segment {
+        _key_t start;
+        _key_t anchor; // the line is base + slope * (k - anchor)
+        double slope;
+        double base;
+        int32_t first;
+        int32_t unused;
+    };
+
+    // behind the slots: the total walk of all buckets and the segments, then a bitmap of occupied buckets
+    struct Extension {
+        int64_t walk_sum;
+        Segment * segs;
+    };
+
+    inline Extension * Ext() {
+        return (Extension *)(recs + capacity);
+    }
+
+    inline int64_t * WalkSum() {
+        return &Ext()->walk_sum;
+    }
+
+    inline Segment * Segments() {
+        return Ext()->segs;
+    }
+
+    inline uint64_t * Occupied() {
+        return (uint64_t *)(recs + capacity + 1);
+    }
+
+    inline int BitmapSlots() {
+        return (capacity / PROBE_SIZE + 127) / 128;
+    }
+
+    // the last occupied bucket before bucket b
+    inline int PrevOccupied(int b) {
+        uint64_t * bitmap = Occupied();
+        int w = b / 64;
+        uint64_t bits = bitmap[w] & ((1UL << (b % 64)) - 1);
+        while(bits == 0) {
+            if(--w < 0) return -1;
+            bits = bitmap[w];
+        }
+        return w * 64 + 63 - __builtin_clzll(bits);
+    }
+
+    // the first occupied bucket after bucket b, or the number of buckets
+    inline int NextOccupied(int b) {
+        uint64_t * bitmap = Occupied();
+        int bucket_num = capacity / PROBE_SIZE;
+        for(int w = b / 64; w * 64 < bucket_num; w++) {
+            uint64_t bits = bitmap[w];
+            if(w == b / 64) 
+                bits &= ~((2UL << (b % 64)) - 1);
+            if(bits != 0) 
+                return std::min(w * 64 + __builtin_ctzll(bits), bucket_num);
+        }
+        return bucket_num;
+    }
+
+    // all models predict through this, so that a line copied into a segment predicts the same slots
+    static inline double LineAt(double base, double slope, _key_t anchor, _key_t k) {
+        return base + slope * (k - anchor);
+    }
+
     inline int Predict(_key_t k) {
-        return std::min(std::max(0.0, slope * k + intercept), capacity - 1.0);
+        if(seg_num == 0)
+            return std::min(std::max(0.0, LineAt(intercept, slope, 0, k)), capacity - 1.0);
+        else
+            return PredictSegment(k, 0, seg_num);
+    }
+
+    // predict by the segments in [lo, hi), the last of them starting no later than k is used
+    inline int PredictSegment(_key_t k, int lo, int hi) {
+        // find the last segment starting no later than k, without branches
+        Segment * segs = Segments();
+        int l = lo;
+        for(int len = hi - lo; len > 1; len -= len / 2) {
+            int half = len / 2;
+            l = (segs[l + half].start <= k) ? l + half : l;
+        }
+
+        int last = std::max(segs[l].first, (l + 1 < seg_num ? segs[l + 1].first : capacity) - 1);
+        double predict = LineAt(segs[l].base, segs[l].slope, segs[l].anchor, k);
+        return std::min(std::max((double)segs[l].first, predict), (double)last);
     }
 
     bool shouldRebuild() {
         return of_count >= count / 4 || count >= capacity;
     }
+
+    // removals have left the node less than half as full as it was built
+    bool shouldShrink() {
+        return count < BNODE_SIZE || count * 6 < capacity;
+    }
     
     void RebuildSubTree();
 
-    void Dump(std::vector<Record> & out);
+    // re-layout the congested region around bucket b with a model of its own
+    void RepairRegion(int b);
+
+    void Populate(Record * recs_in, int num);
+
+    int BucketCount(int b);
+
+    int64_t RegionWalk(int from, int to, int & longest);
+
+    void GatherRegion(int L, int R, std::vector<Record> & out, std::vector<ROInner *> & overflows);
+
+    void ClearRegion(int L, int R, std::vector<ROInner *> & overflows);
+
+    void RefreshRegion(int L, int R, int64_t old_walk);
+
+    void BuildError();
+
+    void Occupy(int b);
+
+    void Vacate(int b);
+
+    // the first index record of a node in either mode
+    Record * First();
+
+    // the slot routing k, probing from the slot predicted for k
+    int RouteSlot(_key_t k, int predict);
+
+    // lookup from the slot predicted for k
+    bool LookupPredicted(_key_t k, int predict, _val_t &v);
 
 public:
     static const int PROBE_SIZE       = 4;
     static const int BNODE_SIZE       = 12;
+    static const int PLA_ERROR        = PROBE_SIZE; // the maximum rank error of a segment
+    static const int WALK_BOUND       = 8;          // nodes with a larger error skip empty buckets by bitmap
+    static const int REPAIR_SIZE      = 2 * PROBE_SIZE; // overflow nodes of this size trigger a local repair
+    static const int OVERFLOW_DEPTH   = CONFIG_OVERFLOW_DEPTH; // deeper chains of overflow nodes trigger a local repair
 
     int32_t capacity;
     int32_t count;
     
-    // model
+    // model: a single linear model, or seg_num segments
     double slope;
     double intercept;
     // data
     Record *recs;
     int32_t of_count;
-    char dummy[4];
+    int16_t seg_num;
+    int16_t max_err; // bounds the longest walk over buckets, only grows until the error is rebuilt
+};
+
+// A radix table in front of the root, in the style of RadixSpline: a normalized key 
+// indexes a small cache-resident table, which narrows the segments of the root down to 
+// the one or two that may cover the key, instead of a binary search over all of them
+class RadixTable {
+public:
+    // build from the segments of the root, the table stays empty if there are none
+    void Build(BaseNode * root);
+
+    inline bool Empty() { return table_.empty(); }
+
+    inline void Lookup(ROInner * root, _key_t k, _val_t &v) {
+        int c = Cell(k);
+        root->LookupPredicted(k, root->PredictSegment(k, table_[c], table_[c + 1] + 1), v);
+    }
+
+    inline int Slot(ROInner * root, _key_t k) {
+        int c = Cell(k);
+        return root->RouteSlot(k, root->PredictSegment(k, table_[c], table_[c + 1] + 1));
+    }
+
+private:
+    inline int Cell(_key_t k) {
+        double c = (k <= min_key_ ? 0.0 : (double)(k - min_key_) * factor_);
+        return (int)std::min(c, table_.size() - 2.0);
+    }
+
+    _key_t min_key_;
+    double factor_;
+    std::vector<int32_t> table_;
+};
+
+// A read-only snapshot of the upper inner levels in one contiguous array. Each inner node 
+// is cloned with its header right in front of its slots, and the clones point to each other, 
+// so reads walk them like ordinary inner nodes and drop into the pointer-linked nodes below. 
+// Writes go to the original nodes, the snapshot is patched or rebuilt afterwards
+class FlatInner {
+public:
+    // flatten the top FLAT_LEVELS levels under the root
+    void Build(BaseNode * root);
+
+    // k was stored into or removed from an inner node without re-layouts, refresh the root buckets routing it
+    void Patch(BaseNode * root, _key_t k);
+
+    inline bool Empty() { return cells_.empty(); }
+
+    inline BaseNode * Root() { return (BaseNode *) cells_.data(); }
+
+private:
+    static const int HEADER = (sizeof(ROInner) + sizeof(Record) - 1) / sizeof(Record);
+
+    // the number of records a node and its flattened descendants take
+    int64_t Size(ROInner * node, int level);
+
+    ROInner * Flatten(ROInner * node, int level);
+
+    // the records behind the slots of a node: the walk sum, the segments and the bitmap
+    static inline int ExtraSlots(ROInner * node) {
+        return node->count < ROInner::BNODE_SIZE ? 0 : 1 + node->BitmapSlots();
+    }
+
+    std::vector<Record> cells_; // never reallocated between two builds, clones point into it
 };
 
+class WOLeaf;
+
 // read optimized leaf nodes
 class ROLeaf : public BaseNode {
 public:
@@ -114,6 +355,9 @@ public:
 
     ROLeaf(Record * recs_in, int num);
 
+    // morph from a WOLeaf: merge its sorted runs straight into the buckets
+    explicit ROLeaf(WOLeaf * leaf);
+
     ~ROLeaf();
 
     bool Store(_key_t k, _val_t v, _key_t * split_key, ROLeaf ** split_node);
@@ -128,11 +372,35 @@ public:
 
     void Dump(std::vector<Record> & out);
 
+    int Dump(Record * out);
+
     void Print(string prefix);
 
-private:
+    inline int Count() { return count; }
+
+    inline int HeatRegion(_key_t k) {
+        return Predict(k) * HEAT_REGIONS / NODE_SIZE;
+    }
+
+    // the records of the overflow node behind the bucket starting at slot b, 
+    // return its capacity, or 0 if the bucket has none
+    int Overflow(int b, Record ** of_recs);
+
+protected:
+    // reserve extra slots behind the buckets, used by derived layouts
+    explicit ROLeaf(int reserve);
+
+    ROLeaf(Record * recs_in, int num, int reserve);
+
+    ROLeaf(WOLeaf * leaf, int reserve);
+
     void ScanOneBucket(int startPos, Record *result, int & cur, int end);
 
+    // fill the empty buckets with sorted records in one pass, equal keys keep the last value. 
+    // The records of a bucket come in one run, which is placed at once, 
+    // its overflow node sized as the doubling in Store would have left it
+    void PlaceSorted(const Record * in, int num);
+
     void DoSplit(_key_t * split_key, ROLeaf ** split_node);
 
     inline bool ShouldSplit() {
@@ -156,6 +424,47 @@ public:
     char dummy[8];
 };
 
+// read optimized leaf nodes with a small insert buffer, 
+// for workloads with a mixed read/write ratio
+class RWLeaf : public ROLeaf {
+public:
+    RWLeaf();
+
+    RWLeaf(Record * recs_in, int num);
+
+    // morph from a ROLeaf: take over its buckets and overflow nodes
+    explicit RWLeaf(ROLeaf * leaf);
+
+    explicit RWLeaf(WOLeaf * leaf);
+
+    bool Store(_key_t k, _val_t v, _key_t * split_key, RWLeaf ** split_node);
+
+    bool Lookup(_key_t k, _val_t &v);
+
+    bool Update(const _key_t & k, _val_t v);
+
+    bool Remove(const _key_t & k);
+
+    int Scan(const _key_t &startKey, int len, Record *result);
+
+    void Dump(std::vector<Record> & out);
+
+    void Print(string prefix);
+
+    // the records in the buckets and the buffered ones
+    int Count();
+
+    // drain the insert buffer into the buckets
+    void Flush();
+
+private:
+    void DoSplit(_key_t * split_key, RWLeaf ** split_node);
+
+public:
+    // the insert buffer is placed right behind the buckets: recs[NODE_SIZE, NODE_SIZE + BUFFER_SIZE)
+    static const int BUFFER_SIZE = CONFIG_BUFFER;
+};
+
 // write optimzied leaf nodes
 class WOLeaf : public BaseNode {
 public:
@@ -163,6 +472,9 @@ public:
 
     WOLeaf(Record * recs_in, int num);
 
+    // morph from a ROLeaf: stream its records into the initial run
+    explicit WOLeaf(ROLeaf * leaf);
+
     ~WOLeaf();
 
     bool Store(_key_t k, _val_t v, _key_t * split_key, WOLeaf ** split_node);
@@ -179,19 +491,166 @@ public:
 
     void Print(string prefix);
 
+    // sort the unsorted run and gather all the sorted runs, return the number of runs
+    int CollectRuns(Record ** runs, int * lens);
+
+    // removed records and older versions of a key count until the runs are merged, so this is an upper bound
+    inline int Count() { return inital_count + insert_count - remove_count; }
+
+    // removed records stay in the runs with this value, it hides their older versions
+    static inline _val_t Removed() { return (_val_t)UINTPTR_MAX; }
+
+    // removed records still held in the runs
+    inline int Tombstones() { return remove_count; }
+
+    // the number of runs a lookup may search: the initial run, the sorted pieces and the unsorted tail
+    inline int RunCount() {
+        return (inital_count > 0) + (insert_count + PIECE_SIZE - 1) / PIECE_SIZE;
+    }
+
+    static const int MAX_RUN_NUM = GLOBAL_LEAF_SIZE / CONFIG_PIECE + 1;
+
+    inline int HeatRegion(_key_t k) {
+        if(upper <= lower) return 0;
+        double r = (k - lower) / (upper - lower) * HEAT_REGIONS;
+        return std::min(std::max(0.0, r), HEAT_REGIONS - 1.0);
+    }
+
 private:
-    void DoSplit(_key_t * split_key, WOLeaf ** split_node);
+    // split the records of the leaf, as merged by Dump
+    void DoSplit(std::vector<Record> & data, _key_t * split_key, WOLeaf ** split_node);
+
+    // merge all runs into the initial run, dropping removed records and older versions
+    void Compact();
+
+    // replace the runs with their merge, as produced by Dump
+    void Compact(std::vector<Record> & merged);
+
+    // the removed records take enough room to rewrite the runs
+    inline bool ShouldReclaim() {
+        return CONFIG_TOMBSTONE_RATIO > 0 && remove_count > 0 
+                && remove_count >= CONFIG_TOMBSTONE_RATIO * (inital_count + insert_count);
+    }
+
+    // the newest version of k, searching the runs from the newest to the oldest
+    Record * FindNewest(_key_t k);
 
     static const int NODE_SIZE = GLOBAL_LEAF_SIZE;
     static const int PIECE_SIZE = CONFIG_PIECE;
+    static const int COMPACT_PIECES = CONFIG_COMPACT_PIECES;
+    static const int RECLAIM_FILL = GLOBAL_LEAF_SIZE * 3 / 4; // a full leaf splits if it stays fuller than this
+    static const int FILTER_WORDS = (PIECE_SIZE * 8 + 63) / 64; // 8 bits per key
+
+    // a linear model over a sorted run, a key of the run lies within max_err of its prediction
+    struct RunModel {
+        double slope;
+        double intercept;
+        int max_err;
+
+        inline void Train(Record * run, int len) {
+            LinearModelBuilder model;
+            model.build(run, 0, len);
+            slope = model.a_;
+            intercept = model.b_;
+
+            max_err = 0;
+            for(int i = 0; i < len; i++) {
+                max_err = std::max(max_err, std::abs(Predict(run[i].key, len) - i));
+            }
+        }
+
+        inline int Predict(_key_t k, int len) {
+            return std::min(std::max(0.0, slope * k + intercept), len - 1.0);
+        }
+
+        // narrow the run down to the window that holds k if the run does
+        inline Record * Window(Record * run, int len, _key_t k, int & win_len) {
+            int predict = Predict(k, len);
+            int lo = std::max(0, predict - max_err), hi = std::min(len, predict + max_err + 1);
+            win_len = hi - lo;
+            return run + lo;
+        }
+    };
+
+    // A summary of one piece after the initial run: the range of its keys, and a bloom filter 
+    // blocked into 64-bit words, so that a probe reads a single word. It is filled as records 
+    // are appended, so the unsorted tail has one as well
+    struct PieceFilter {
+        _key_t min_key;
+        _key_t max_key;
+        RunModel model; // trained once the piece is sorted
+        uint64_t bits[FILTER_WORDS];
+
+        inline void Reset() {
+            min_key = MAX_KEY;
+            max_key = MIN_KEY;
+            memset(bits, 0, sizeof(bits));
+        }
+
+        inline void Add(_key_t k) {
+            min_key = std::min(min_key, k);
+            max_key = std::max(max_key, k);
+            uint64_t h = Hash(k);
+            bits[(h >> 32) % FILTER_WORDS] |= Mask(h);
+        }
+
+        inline bool MayContain(_key_t k) {
+            if(k < min_key || k > max_key) return false;
+            uint64_t h = Hash(k), mask = Mask(h);
+            return (bits[(h >> 32) % FILTER_WORDS] & mask) == mask;
+        }
+
+        static inline uint64_t Hash(_key_t k) {
+            if(k == 0) k = 0; // -0.0 and 0.0 are one key
+            uint64_t h = 0;
+            memcpy(&h, &k, std::min(sizeof(h), sizeof(k)));
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        static inline uint64_t Mask(uint64_t h) {
+            return (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63)) | (1ULL << ((h >> 12) & 63));
+        }
+    };
+
+    // An open addressing table over the unsorted tail: each slot holds a fingerprint of 
+    // a key and its offset in the tail plus one, 0 marks an empty slot. It is cleared 
+    // when a new piece starts, and rebuilt when the tail is sorted in place
+    struct TailSlot {
+        uint16_t fp;
+        uint16_t pos;
+    };
+
+    static const int TAIL_SLOTS = 2 * PIECE_SIZE; // the load factor stays below one half
+
+    // the offset in the tail of the record with key k, or -1
+    int ProbeTail(_key_t k);
+
+    void IndexTail(_key_t k, int pos);
+
+    void RebuildTail();
+
+    // behind the records live the model of the initial run, the filters of the pieces and the tail table
+    static const int EXT_SLOTS = (sizeof(RunModel) + sizeof(PieceFilter) * MAX_RUN_NUM 
+                                    + sizeof(TailSlot) * TAIL_SLOTS + sizeof(Record) - 1) / sizeof(Record);
+
+    inline RunModel * InitialModel() { return (RunModel *)(recs + NODE_SIZE); }
+
+    inline PieceFilter * Filters() { return (PieceFilter *)((char *)(recs + NODE_SIZE) + sizeof(RunModel)); }
+
+    inline TailSlot * TailTable() { return (TailSlot *)(Filters() + MAX_RUN_NUM); }
 
     // meta data
     Record * recs; 
     int16_t inital_count;
     int16_t insert_count;
-    int16_t swap_pos;
     int16_t unused;
-    char dummy[24];
+    int16_t remove_count;
+    _key_t lower; // key range seen by this node, used to locate heat regions
+    _key_t upper;
+    char dummy[8];
 };
 
 // Swap the metadata of two nodes
@@ -208,8 +667,34 @@ extern bool do_morphing;
 extern uint64_t global_stats;
 extern void MorphNode(BaseNode * leaf, NodeType from, NodeType to);
 
+// Consolidate an idle leaf towards the leaf type of the global phase, 
+// return true if the leaf is still being written and needs another visit
+extern bool SweepLeaf(BaseNode * leaf, NodeType phase);
+
+// Create a leaf node of a given type from sorted records
+extern BaseNode * NewLeaf(NodeType type, Record * recs, int num);
+
+// Helpers to seed the access statistic of a leaf node
+extern NodeType TypeOfStats(int one_count);
+extern uint64_t StatsOf(int one_count);
+extern uint64_t DefaultStats(NodeType type);
+
+// Split the sorted records of a leaf into two new leaves, their types, 
+// initial statistics and the split position are decided by the heat of the leaf
+extern void SplitLeaf(BaseNode * leaf, std::vector<Record> & data, _key_t * split_key, 
+                        BaseNode ** left, BaseNode ** right);
+
+// Merge the live records of a leaf into its left sibling, which takes over its sibling link. 
+// The caller drops the index record of the right leaf and frees it
+extern void MergeLeaf(BaseNode * left, BaseNode * right);
+
+// Drop the records of a leaf in [lo, hi), return the number of records dropped
+extern int TrimLeaf(BaseNode * leaf, _key_t lo, _key_t hi);
+
 extern uint32_t rebuild_times;
+extern uint32_t repair_times;
 extern uint32_t morph_times;
+extern uint64_t reclaimed_bytes; // record slots freed by WOLeaf compactions, in bytes
 
 } // namespace morphtree
 
@@ -4,6 +4,8 @@
 
 #include <cstring>
 #include <cmath>
+#include <limits>
+#include <vector>
 
 #include "node.h"
 
@@ -11,10 +13,74 @@ namespace morphtree {
 
 static const int MARGIN = ROInner::PROBE_SIZE;
 
+// Segment the keys greedily with a shrinking cone, so that the rank of every key 
+// is within error of its segment. Return the start positions and slopes (ranks per key)
+static void SegmentKeys(Record * recs, int num, int error, std::vector<int> & starts, std::vector<double> & slopes) {
+    int start = 0;
+    double lo = 0, hi = std::numeric_limits<double>::max();
+    for(int i = 1; i < num; i++) {
+        double dx = recs[i].key - recs[start].key;
+        double dy = i - start;
+        if(dy / dx < lo || dy / dx > hi) { // out of the cone, close the segment
+            starts.push_back(start);
+            slopes.push_back(i - start > 1 ? (lo + hi) / 2 : 0);
+            start = i;
+            lo = 0;
+            hi = std::numeric_limits<double>::max();
+        } else {
+            lo = std::max(lo, (dy - error) / dx);
+            hi = std::min(hi, (dy + error) / dx);
+        }
+    }
+    starts.push_back(start);
+    slopes.push_back(num - start > 1 ? (lo + hi) / 2 : 0);
+}
+
+// Segment the keys to be placed in slots [first, end) at scale slots per key from offset. A loose 
+// error saves segments, but a dense cluster of keys then shares the predictions of its neighbours 
+// and overflows into chains of inner nodes, so the error is tightened until few keys would overflow, 
+// or until a tighter error would need more than max_segs segments
+static void FitSegments(Record * recs, int num, double scale, double offset, int first, int end, 
+                            int max_segs, std::vector<int> & starts, std::vector<double> & slopes) {
+    const int PROBE_SIZE = ROInner::PROBE_SIZE;
+    for(int error = ROInner::PLA_ERROR; ; error /= 2) {
+        std::vector<int> tight_starts;
+        std::vector<double> tight_slopes;
+        SegmentKeys(recs, num, error, tight_starts, tight_slopes);
+        if(error < ROInner::PLA_ERROR && (int)tight_starts.size() > max_segs) 
+            return;
+        starts.swap(tight_starts);
+        slopes.swap(tight_slopes);
+        if(error <= 1) 
+            return;
+
+        // count the keys beyond the capacity of their buckets, predicted as ROInner::PredictSegment does
+        int overflow = 0, run = 0, last_bucket = -1;
+        for(int s = 0; s < (int)starts.size(); s++) {
+            int lo = (s == 0 ? first : (int)(starts[s] * scale + offset));
+            int hi = (s + 1 < (int)starts.size() ? (int)(starts[s + 1] * scale + offset) : end) - 1;
+            for(int i = starts[s]; i < (s + 1 < (int)starts.size() ? starts[s + 1] : num); i++) {
+                double predict = starts[s] * scale + offset + slopes[s] * scale * (recs[i].key - recs[starts[s]].key);
+                int bucket = (int)std::min(std::max((double)lo, predict), (double)std::max(lo, hi)) / PROBE_SIZE;
+                run = (bucket == last_bucket ? run + 1 : 1);
+                overflow += (run > PROBE_SIZE ? 1 : 0);
+                last_bucket = bucket;
+            }
+        }
+        if(overflow < num / 16) 
+            return;
+    }
+}
+
 ROInner::ROInner(Record * recs_in, int num) {
     node_type = NodeType::ROINNER;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
     count = num;
     of_count = 0;
+    seg_num = 0;
+    max_err = 0;
     recs = nullptr;
 
     if(num < BNODE_SIZE) {
@@ -25,21 +91,59 @@ ROInner::ROInner(Record * recs_in, int num) {
         return ;
     } else {
         capacity = (num * 3 + PROBE_SIZE - 1) / PROBE_SIZE * PROBE_SIZE;
-        recs = new Record[capacity];
     }
 
     // train a model
     LinearModelBuilder model;
-    for(int i = num / 8; i < num * 7 / 8; i++) {
-        model.add(recs_in[i].key, i);
-    }
-    model.build();
+    model.build(recs_in, num / 8, num * 7 / 8);
 
     // store the model 
-    slope = model.a_ * (capacity - 2 * MARGIN) / num;
-    intercept = model.b_ * (capacity - 2 * MARGIN) / num + MARGIN;
+    double scale = (double)(capacity - 2 * MARGIN) / num;
+    slope = model.a_ * scale;
+    intercept = model.b_ * scale + MARGIN;
+
+    // count the records that would overflow their buckets under the single model
+    int predict_of = 0;
+    for(int i = 0, last_i = 0, cid = Predict(recs_in[0].key) / PROBE_SIZE; i <= num; i++) {
+        if(i == num || Predict(recs_in[i].key) / PROBE_SIZE != cid) {
+            predict_of += std::max(0, i - last_i - PROBE_SIZE + 1);
+            if(i < num) {
+                last_i = i;
+                cid = Predict(recs_in[i].key) / PROBE_SIZE;
+            }
+        }
+    }
+
+    // skewed keys: replace the single model with error-bounded segments, 
+    // each of them owns slots in proportion to its number of keys
+    std::vector<int> starts;
+    std::vector<double> slopes;
+    if(predict_of >= num / 16) {
+        FitSegments(recs_in, num, scale, MARGIN, 0, capacity, INT16_MAX, starts, slopes);
+    }
+
+    recs = new Record[capacity + 1 + BitmapSlots()];
+    if(starts.size() > 1 && starts.size() <= INT16_MAX) {
+        seg_num = starts.size();
+        Segment * segs = new Segment[seg_num];
+        for(int s = 0; s < seg_num; s++) {
+            segs[s].start = recs_in[starts[s]].key;
+            segs[s].anchor = segs[s].start;
+            segs[s].slope = slopes[s] * scale;
+            segs[s].base = starts[s] * scale + MARGIN;
+            segs[s].first = (s == 0 ? 0 : (int)segs[s].base);
+        }
+        Ext()->segs = segs;
+    } else {
+        Ext()->segs = nullptr;
+    }
+
+    Populate(recs_in, num);
+    BuildError();
+}
 
-    // populate the node with records
+// Place sorted records into their predicted buckets, spilling crowded buckets into overflow nodes
+void ROInner::Populate(Record * recs_in, int num) {
     int i, last_i = 0, cid = Predict(recs_in[0].key) / PROBE_SIZE;
     for(i = 1; i < num; i++) {
         int predict = Predict(recs_in[i].key);
@@ -71,20 +175,78 @@ ROInner::ROInner(Record * recs_in, int num) {
     }
 }
 
+// Record the occupied buckets, and the walk a lookup takes from each bucket 
+// back to the nearest occupied one when the bucket is mispredicted
+void ROInner::BuildError() {
+    int bucket_num = capacity / PROBE_SIZE;
+    uint64_t * bitmap = Occupied();
+    memset(bitmap, 0, BitmapSlots() * sizeof(Record));
+
+    int64_t walk_sum = 0;
+    int err = 0, last = -1;
+    for(int b = 0; b < bucket_num; b++) {
+        if(last >= 0) 
+            err = std::max(err, b - last);
+
+        if(recs[b * PROBE_SIZE].key != MAX_KEY) {
+            bitmap[b / 64] |= 1UL << (b % 64);
+            last = b;
+        } else if(last >= 0) {
+            walk_sum += b - last;
+        }
+    }
+
+    *WalkSum() = walk_sum;
+    max_err = std::min(err, (int)INT16_MAX);
+}
+
+// Bucket b receives its first record: it splits the run of empty buckets it was in
+void ROInner::Occupy(int b) {
+    uint64_t * bitmap = Occupied();
+    int p = PrevOccupied(b);
+    int n = NextOccupied(b);
+
+    int64_t & walk_sum = *WalkSum();
+    if(p >= 0) { // the buckets after b walk b - p buckets less
+        walk_sum -= (int64_t)(n - b) * (b - p);
+    } else { // the buckets after b are now reachable from b
+        walk_sum += (int64_t)(n - b - 1) * (n - b) / 2;
+        max_err = std::min(std::max((int)max_err, n - b), (int)INT16_MAX);
+    }
+    bitmap[b / 64] |= 1UL << (b % 64);
+}
+
+// Bucket b loses its last record: the buckets up to the next occupied one walk further back
+void ROInner::Vacate(int b) {
+    uint64_t * bitmap = Occupied();
+    bitmap[b / 64] &= ~(1UL << (b % 64));
+    int p = PrevOccupied(b);
+    int n = NextOccupied(b);
+
+    int64_t & walk_sum = *WalkSum();
+    if(p >= 0) { // the buckets from b walk b - p buckets more
+        walk_sum += (int64_t)(n - b) * (b - p);
+        max_err = std::min(std::max((int)max_err, n - p), (int)INT16_MAX);
+    } else { // the buckets after b are no longer reachable by walks
+        walk_sum -= (int64_t)(n - b - 1) * (n - b) / 2;
+    }
+}
+
 ROInner::~ROInner() {
     for(int i = PROBE_SIZE - 1; i < capacity; i += PROBE_SIZE) {
         BaseNode * child = (ROInner *) recs[i].val;
-        if(child != nullptr && !child->Leaf()) {
-            ((ROInner *)child)->Clear();
-            delete child;
+        if(child != nullptr && !child->Leaf()) { // the overflow nodes nested in it go with it
+            delete (ROInner *) child;
         }
     }
 
+    if(seg_num > 0) 
+        delete [] Segments();
     delete [] recs;
 }
 
 void ROInner::Print(string prefix) {
-    printf("%s(%d, %d %d)[", prefix.c_str(), node_type, count, capacity);
+    printf("%s(%d, %d %d %d %d)[", prefix.c_str(), node_type, count, capacity, seg_num, max_err);
     for(int i = 0; i < capacity; i++) {
         if(i % PROBE_SIZE == PROBE_SIZE - 1) {
             printf("><");
@@ -101,12 +263,16 @@ void ROInner::Print(string prefix) {
     }
 }
 
-bool ROInner::Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_node) {
+bool ROInner::Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_node, int slot) {
     if(count < BNODE_SIZE) {
         int i;
-        for(i = 0; i < count; i++) {
-            if(recs[i].key > k) {
-                break;
+        if(slot >= 0 && slot < count && recs[slot].key <= k && (slot + 1 == count || recs[slot + 1].key > k)) { // k goes right after the slot routing it
+            i = slot + 1;
+        } else {
+            for(i = 0; i < count; i++) {
+                if(recs[i].key > k) {
+                    break;
+                }
             }
         }
 
@@ -121,19 +287,30 @@ bool ROInner::Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_nod
             delete new_inner;
         }
     } else {
-        int predict = Predict(k);
-        predict = (predict / PROBE_SIZE) * PROBE_SIZE;
+        int predict, i;
+        if(slot >= 0 && slot % PROBE_SIZE != PROBE_SIZE - 1 && recs[slot].key <= k 
+                && recs[slot + 1].key != MAX_KEY && recs[slot + 1].key > k) {
+            // k lies between two records of one bucket, so the model predicts that bucket for k as well
+            predict = slot / PROBE_SIZE * PROBE_SIZE;
+            i = slot + 1;
+        } else {
+            predict = Predict(k);
+            predict = (predict / PROBE_SIZE) * PROBE_SIZE;
 
-        int i;
-        for (i = predict; i < predict + PROBE_SIZE; i++) {
-            if(recs[i].key > k)
-                break;
+            for (i = predict; i < predict + PROBE_SIZE; i++) {
+                if(recs[i].key > k)
+                    break;
+            }
         }
 
+        int congested = -1;
         Record last_one = recs[predict + PROBE_SIZE - 1];
         if(last_one.key == MAX_KEY) { // there is an empty slot
+            bool first_one = recs[predict].key == MAX_KEY;
             memmove(&recs[i + 1], &recs[i], sizeof(Record) * (predict + PROBE_SIZE - 1 - i));
             recs[i] = Record(k, v);
+            if(first_one) 
+                Occupy(predict / PROBE_SIZE);
         } else {
             BaseNode * rightmost = (BaseNode *)last_one.val;
             if(rightmost->Leaf()) { // has no overflow inner node
@@ -150,6 +327,7 @@ bool ROInner::Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_nod
                 recs[predict + PROBE_SIZE - 1].val = new_inner;
                 of_count += 2;
             } else { // has a overflow inner node
+                _key_t of_k = k;
                 if(i < predict + PROBE_SIZE - 1) {
                     _key_t new_k = recs[predict + PROBE_SIZE - 2].key;
                     _val_t new_v = recs[predict + PROBE_SIZE - 2].val;
@@ -158,6 +336,7 @@ bool ROInner::Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_nod
                     
                     rightmost->Store(new_k, new_v, nullptr, nullptr);
                     recs[predict + PROBE_SIZE - 1].key = new_k; // update the split key of bucket and overflow node
+                    of_k = new_k;
                 } else if(i == predict + PROBE_SIZE - 1) { 
                     rightmost->Store(k, v, nullptr, nullptr);
                     recs[predict + PROBE_SIZE - 1].key = k; // update the split key of bucket and overflow node
@@ -165,12 +344,20 @@ bool ROInner::Store(_key_t k, _val_t v, _key_t * split_key, ROInner ** split_nod
                     rightmost->Store(k, v, nullptr, nullptr);
                 }
                 of_count += 1;
+
+                // a crowded bucket, or a chain of overflow nodes too deep for lookups to walk through
+                int depth;
+                ((ROInner *)rightmost)->Route(of_k, &depth);
+                if(((ROInner *)rightmost)->count >= REPAIR_SIZE || depth > OVERFLOW_DEPTH)
+                    congested = predict / PROBE_SIZE;
             }
         }
         count += 1;
 
         if(shouldRebuild()) {
             RebuildSubTree();
+        } else if(congested >= 0) {
+            RepairRegion(congested);
         }
     }
 
@@ -188,27 +375,363 @@ bool ROInner::Lookup(_key_t k, _val_t &v) {
         v = recs[i - 1].val;
         return true;
     } else {
-        int predict = Predict(k);
-        predict = (predict / PROBE_SIZE) * PROBE_SIZE;
+        return LookupPredicted(k, Predict(k), v);
+    }
+}
+
+int ROInner::Slot(_key_t k) {
+    if(count < BNODE_SIZE) {
+        int i = 1;
+        for(; i < count && recs[i].key <= k; i++);
+        return i - 1;
+    } else {
+        return RouteSlot(k, Predict(k));
+    }
+}
+
+int ROInner::RouteSlot(_key_t k, int predict) {
+    predict = (predict / PROBE_SIZE) * PROBE_SIZE;
 
-        // probe left: if k is less than the minimal key in current bucket
-        while(recs[predict].key > k) {
-            predict -= PROBE_SIZE;
+    // probe left: if k is less than the minimal key in current bucket, 
+    // walk the buckets for small errors, otherwise jump to the nearest occupied bucket
+    if(recs[predict].key > k) {
+        if(max_err <= WALK_BOUND) {
+            do {
+                predict -= PROBE_SIZE;
+            } while(recs[predict].key > k);
+        } else {
+            do {
+                predict = PrevOccupied(predict / PROBE_SIZE) * PROBE_SIZE;
+            } while(recs[predict].key > k);
         }
+    }
 
-        // probe right by 1 to find a proper index record
-        int i = predict + 1;
-        for (; i < predict + PROBE_SIZE; i++) {
-            if(recs[i].key > k) {
-                v = recs[i - 1].val;
-                return true;
-            }
+    // probe right by 1 to find a proper index record
+    int i = predict + 1;
+    for (; i < predict + PROBE_SIZE; i++) {
+        if(recs[i].key > k) {
+            return i - 1;
         }
+    }
 
-        // this bucket is probed
-        v = recs[i - 1].val;
+    // this bucket is probed
+    return i - 1;
+}
+
+bool ROInner::LookupPredicted(_key_t k, int predict, _val_t &v) {
+    v = recs[RouteSlot(k, predict)].val;
+    return true;
+}
+
+Record * ROInner::Route(_key_t k, int * depth) {
+    ROInner * node = this;
+    for(int d = 1; ; d++) {
+        Record * r;
+        if(node->count < BNODE_SIZE) {
+            int i = 1;
+            for(; i < node->count && node->recs[i].key <= k; i++);
+            r = &node->recs[i - 1];
+        } else {
+            r = &node->recs[node->RouteSlot(k, node->Predict(k))];
+        }
+
+        // descend into the overflow node that r might be
+        BaseNode * child = (BaseNode *) r->val;
+        if(node->count < BNODE_SIZE || (r - node->recs) % PROBE_SIZE != PROBE_SIZE - 1 || child->Leaf()) {
+            if(depth != nullptr) *depth = d;
+            return r;
+        }
+        node = (ROInner *) child;
+    }
+}
+
+// Free an overflow node, along with the overflow nodes nested in it
+static void FreeOverflow(ROInner * node) {
+    for(int i = ROInner::PROBE_SIZE - 1; i < node->capacity; i += ROInner::PROBE_SIZE) {
+        BaseNode * child = (BaseNode *) node->recs[i].val;
+        if(node->recs[i].key != MAX_KEY && !child->Leaf()) {
+            FreeOverflow((ROInner *) child);
+        }
+    }
+
+    node->Clear();
+    delete node;
+}
+
+Record * ROInner::First() {
+    if(count < BNODE_SIZE || recs[0].key != MAX_KEY) 
+        return recs;
+    else 
+        return recs + NextOccupied(0) * PROBE_SIZE;
+}
+
+bool ROInner::Remove(const _key_t & k) {
+    if(count < BNODE_SIZE) {
+        int i;
+        for(i = 0; i < count && recs[i].key != k; i++);
+        if(i == count) return false;
+
+        memmove(&recs[i], &recs[i + 1], sizeof(Record) * (count - 1 - i));
+        recs[count - 1] = Record();
+        count -= 1;
         return true;
     }
+
+    // the bucket routing k holds its record, or the overflow node of the bucket does
+    int predict = RouteSlot(k, Predict(k)) / PROBE_SIZE * PROBE_SIZE;
+    Record * bucket = recs + predict;
+    Record & last_one = bucket[PROBE_SIZE - 1];
+    ROInner * overflow = nullptr;
+    if(last_one.key != MAX_KEY && !((BaseNode *) last_one.val)->Leaf()) 
+        overflow = (ROInner *) last_one.val;
+
+    if(overflow != nullptr && k >= last_one.key) {
+        if(!overflow->Remove(k)) return false;
+        of_count -= 1;
+    } else {
+        int i;
+        for(i = 0; i < PROBE_SIZE && bucket[i].key != k; i++);
+        if(i == PROBE_SIZE || bucket[i].key == MAX_KEY) return false;
+
+        if(overflow == nullptr) {
+            memmove(&bucket[i], &bucket[i + 1], sizeof(Record) * (PROBE_SIZE - 1 - i));
+            last_one = Record();
+        } else { // shift one record from the overflow node into the bucket
+            memmove(&bucket[i], &bucket[i + 1], sizeof(Record) * (PROBE_SIZE - 2 - i));
+            bucket[PROBE_SIZE - 2] = *overflow->First();
+            overflow->Remove(bucket[PROBE_SIZE - 2].key);
+            of_count -= 1;
+        }
+    }
+
+    if(overflow != nullptr) { // update the split key of bucket and overflow node
+        if(overflow->count == 1) { // the last record moves back into the bucket
+            last_one = overflow->recs[0];
+            of_count -= 1;
+            FreeOverflow(overflow);
+        } else {
+            last_one.key = overflow->First()->key;
+        }
+    }
+
+    if(bucket[0].key == MAX_KEY) 
+        Vacate(predict / PROBE_SIZE);
+    count -= 1;
+
+    if(shouldShrink()) 
+        RebuildSubTree();
+    return true;
+}
+
+// The number of records under bucket b, including those in its overflow node
+int ROInner::BucketCount(int b) {
+    Record * bucket = recs + b * PROBE_SIZE;
+    int c = 0;
+    for(; c < PROBE_SIZE && bucket[c].key != MAX_KEY; c++);
+
+    BaseNode * rightmost = (BaseNode *) bucket[PROBE_SIZE - 1].val;
+    if(c == PROBE_SIZE && !rightmost->Leaf()) {
+        c += ((ROInner *) rightmost)->count - 1;
+    }
+    return c;
+}
+
+// The total walk of the empty buckets in [from, to), and the longest walk ending in [from, to]
+int64_t ROInner::RegionWalk(int from, int to, int & longest) {
+    int bucket_num = capacity / PROBE_SIZE;
+    int last = PrevOccupied(from);
+    int64_t walk = 0;
+    longest = 0;
+    for(int b = from; b <= to && b < bucket_num; b++) {
+        if(last >= 0)
+            longest = std::max(longest, b - last);
+        
+        if(recs[b * PROBE_SIZE].key != MAX_KEY)
+            last = b;
+        else if(last >= 0 && b < to) 
+            walk += b - last;
+    }
+    return walk;
+}
+
+// Instead of rebuilding the whole node for one congested bucket, grow a window around it 
+// until the window is at most half full, then give the window a segment of its own and 
+// re-layout only the records in it. The cost scales with the window, not the node
+void ROInner::RepairRegion(int b) {
+    repair_times += 1;
+    int bucket_num = capacity / PROBE_SIZE;
+    int L = b, R = b + 1, num = BucketCount(b);
+    while(num * 2 > (R - L) * PROBE_SIZE) {
+        int grow = (R - L + 1) / 2;
+        if((R - L) + 2 * grow > bucket_num / 4) { // too wide a damage, fall back to a full rebuild
+            RebuildSubTree();
+            return;
+        }
+
+        for(int j = 0; j < grow && L > 0; j++) 
+            num += BucketCount(--L);
+        for(int j = 0; j < grow && R < bucket_num; j++) 
+            num += BucketCount(R++);
+    }
+
+    // let the window start and end at occupied buckets, so that both ends have a key to split the segments
+    if(recs[L * PROBE_SIZE].key == MAX_KEY) {
+        int p = PrevOccupied(L);
+        if(p >= 0) 
+            num += BucketCount(p);
+        L = std::max(p, 0);
+    }
+    if(R < bucket_num && recs[R * PROBE_SIZE].key == MAX_KEY) {
+        R = NextOccupied(R);
+    }
+    _key_t kR = (R < bucket_num ? recs[R * PROBE_SIZE].key : MAX_KEY);
+
+    // gather the records of the window
+    std::vector<Record> window;
+    std::vector<ROInner *> overflows;
+    window.reserve(num);
+    GatherRegion(L, R, window, overflows);
+
+    // segment the window, each segment owns slots of the window in proportion to its number of keys
+    int m = window.size();
+    double scale = (double)(R - L) * PROBE_SIZE / m;
+    std::vector<int> starts;
+    std::vector<double> slopes;
+    FitSegments(window.data(), m, scale, L * PROBE_SIZE, L * PROBE_SIZE, R * PROBE_SIZE, 
+                    INT16_MAX - seg_num - 3, starts, slopes);
+    if(seg_num + starts.size() + 2 >= INT16_MAX) {
+        RebuildSubTree();
+        return;
+    }
+
+    // splice them into the directory: segments before the window stay, 
+    // the line that used to predict kR carries on from the end of the window
+    Segment single = {MIN_KEY, 0, slope, intercept, 0, 0};
+    Segment * old = (seg_num > 0 ? Segments() : &single);
+    int old_num = std::max((int)seg_num, 1);
+
+    std::vector<Segment> segs;
+    int active = 0;
+    for(int s = 0; s < old_num; s++) {
+        if(old[s].start < window[0].key) 
+            segs.push_back(old[s]);
+        if(old[s].start <= kR) 
+            active = s;
+    }
+    for(int s = 0; s < (int)starts.size(); s++) {
+        Segment local;
+        local.start = window[starts[s]].key;
+        local.anchor = local.start;
+        local.slope = slopes[s] * scale;
+        local.base = starts[s] * scale + L * PROBE_SIZE;
+        local.first = (s == 0 ? L * PROBE_SIZE : (int)local.base);
+        segs.push_back(local);
+    }
+    if(R < bucket_num) {
+        Segment right = old[active];
+        right.start = kR;
+        right.first = R * PROBE_SIZE;
+        segs.push_back(right);
+        for(int s = active + 1; s < old_num; s++) 
+            segs.push_back(old[s]);
+    }
+
+    // re-layout the window
+    int longest;
+    int64_t old_walk = RegionWalk(L, R, longest);
+    ClearRegion(L, R, overflows);
+
+    if(seg_num > 0) 
+        delete [] Segments();
+    seg_num = segs.size();
+    Ext()->segs = new Segment[seg_num];
+    std::copy(segs.begin(), segs.end(), Ext()->segs);
+
+    Populate(window.data(), m);
+    RefreshRegion(L, R, old_walk);
+}
+
+// Append the records of the buckets [L, R) to out, and collect their overflow nodes
+void ROInner::GatherRegion(int L, int R, std::vector<Record> & out, std::vector<ROInner *> & overflows) {
+    for(int i = L * PROBE_SIZE; i < R * PROBE_SIZE; i += PROBE_SIZE) {
+        for(int j = 0; j < PROBE_SIZE && recs[i + j].key != MAX_KEY; j++) {
+            BaseNode * node = (BaseNode *) recs[i + j].val;
+            if(j == PROBE_SIZE - 1 && !node->Leaf()) {
+                ((ROInner *)node)->Dump(out);
+                overflows.push_back((ROInner *)node);
+            } else {
+                out.push_back(recs[i + j]);
+            }
+        }
+    }
+}
+
+// Empty the buckets [L, R) and free their overflow nodes
+void ROInner::ClearRegion(int L, int R, std::vector<ROInner *> & overflows) {
+    for(auto node : overflows) {
+        of_count -= node->count;
+        FreeOverflow(node);
+    }
+    std::fill(recs + L * PROBE_SIZE, recs + R * PROBE_SIZE, Record());
+}
+
+// Refresh the occupied buckets and the prediction error of the re-laid out buckets [L, R)
+void ROInner::RefreshRegion(int L, int R, int64_t old_walk) {
+    uint64_t * bitmap = Occupied();
+    for(int w = L; w < R; w++) {
+        if(recs[w * PROBE_SIZE].key != MAX_KEY) 
+            bitmap[w / 64] |= 1UL << (w % 64);
+        else 
+            bitmap[w / 64] &= ~(1UL << (w % 64));
+    }
+
+    int longest;
+    int64_t new_walk = RegionWalk(L, R, longest);
+    *WalkSum() += new_walk - old_walk;
+    max_err = std::min(std::max((int)max_err, longest), (int)INT16_MAX);
+}
+
+int ROInner::RemoveRange(_key_t lo, _key_t hi) {
+    if(count < BNODE_SIZE) {
+        int i, j;
+        for(i = 0; i < count && recs[i].key <= lo; i++);
+        for(j = i; j < count && recs[j].key < hi; j++);
+
+        int removed = j - i;
+        memmove(&recs[i], &recs[j], sizeof(Record) * (count - j));
+        std::fill(recs + count - removed, recs + count, Record());
+        count -= removed;
+        return removed;
+    }
+
+    // the records in range lie in the buckets from the one routing lo to the one routing hi
+    int L = RouteSlot(lo, Predict(lo)) / PROBE_SIZE;
+    int R = RouteSlot(hi, Predict(hi)) / PROBE_SIZE + 1;
+    std::vector<Record> window;
+    std::vector<ROInner *> overflows;
+    GatherRegion(L, R, window, overflows);
+
+    auto first = std::upper_bound(window.begin(), window.end(), lo, 
+                    [](_key_t k, const Record & r) { return k < r.key; });
+    auto last = std::lower_bound(first, window.end(), hi, 
+                    [](const Record & r, _key_t k) { return r.key < k; });
+    int removed = last - first;
+    if(removed == 0) 
+        return 0;
+    window.erase(first, last);
+
+    // the model is kept, the rest of the records go back to the buckets they were predicted to
+    int longest;
+    int64_t old_walk = RegionWalk(L, R, longest);
+    ClearRegion(L, R, overflows);
+    if(!window.empty()) 
+        Populate(window.data(), window.size());
+    RefreshRegion(L, R, old_walk);
+
+    count -= removed;
+    if(shouldShrink()) 
+        RebuildSubTree();
+    return removed;
 }
 
 void ROInner::RebuildSubTree() {
@@ -239,6 +762,35 @@ void ROInner::RebuildSubTree() {
     delete new_inner;
 }
 
+void ROInner::DumpError(std::vector<InnerError> & out, bool recount) {
+    int slot_num = count < BNODE_SIZE ? count : capacity;
+    if(count < BNODE_SIZE) {
+        out.push_back({0, 0});
+    } else {
+        if(recount) BuildError();
+        out.push_back({max_err, (double)*WalkSum() / (capacity / PROBE_SIZE)});
+    }
+    
+    for(int i = 0; i < slot_num; i++) {
+        BaseNode * child = (BaseNode *) recs[i].val;
+        if(recs[i].key != MAX_KEY && !child->Leaf()) {
+            ((ROInner *)child)->DumpError(out, recount);
+        }
+    }
+}
+
+int ROInner::Depth() {
+    int slot_num = count < BNODE_SIZE ? count : capacity;
+    int depth = 0;
+    for(int i = 0; i < slot_num; i++) {
+        BaseNode * child = (BaseNode *) recs[i].val;
+        if(recs[i].key != MAX_KEY && !child->Leaf()) {
+            depth = std::max(depth, ((ROInner *)child)->Depth());
+        }
+    }
+    return depth + 1;
+}
+
 void ROInner::Dump(std::vector<Record> & out) {
     for(int i = 0; i < capacity; i += PROBE_SIZE) {
         for(int j = 0; j < PROBE_SIZE; j++) {
@@ -258,4 +810,125 @@ void ROInner::Dump(std::vector<Record> & out) {
     }
 }
 
+void RadixTable::Build(BaseNode * node) {
+    table_.clear();
+
+    ROInner * root = (ROInner *) node;
+    if(RADIX_BITS == 0 || node->Leaf() || root->count < ROInner::BNODE_SIZE || root->seg_num < 2) 
+        return;
+
+    // normalize keys by the segment starts, the first of them might be MIN_KEY
+    ROInner::Segment * segs = root->Segments();
+    int seg_num = root->seg_num;
+    min_key_ = segs[1].start;
+    _key_t max_key = segs[seg_num - 1].start;
+
+    // about one segment per cell, as long as the table fits in L2
+    int cells = 1;
+    while(cells < seg_num && cells < (1 << RADIX_BITS)) 
+        cells *= 2;
+    factor_ = (max_key > min_key_ ? cells / (double)(max_key - min_key_) : 0);
+
+    // cell c starts from the last segment starting in a cell before c, 
+    // the segments of its keys are in [table_[c], table_[c + 1]]
+    table_.resize(cells + 1);
+    int c = 0, last = 0;
+    for(int s = 1; s < seg_num; s++) {
+        for(int sc = Cell(segs[s].start); c <= sc; c++) 
+            table_[c] = last;
+        last = s;
+    }
+    for(; c <= cells; c++) 
+        table_[c] = last;
+}
+
+int64_t FlatInner::Size(ROInner * node, int level) {
+    int64_t size = HEADER + node->capacity + ExtraSlots(node);
+    if(level < FLAT_LEVELS) {
+        for(int i = 0; i < node->capacity; i++) {
+            BaseNode * child = (BaseNode *) node->recs[i].val;
+            if(node->recs[i].key != MAX_KEY && !child->Leaf()) 
+                size += Size((ROInner *) child, level + 1);
+        }
+    }
+    return size;
+}
+
+ROInner * FlatInner::Flatten(ROInner * node, int level) {
+    int slots = node->capacity + ExtraSlots(node);
+    int64_t off = cells_.size();
+    cells_.resize(off + HEADER + slots);
+
+    // the clone shares the segments of the node, and must never be destructed
+    ROInner * clone = (ROInner *) &cells_[off];
+    memcpy((void *)clone, node, sizeof(ROInner));
+    clone->recs = &cells_[off + HEADER];
+    memcpy(clone->recs, node->recs, sizeof(Record) * slots);
+
+    if(level < FLAT_LEVELS) {
+        for(int i = 0; i < node->capacity; i++) {
+            BaseNode * child = (BaseNode *) node->recs[i].val;
+            if(node->recs[i].key != MAX_KEY && !child->Leaf()) 
+                clone->recs[i].val = Flatten((ROInner *) child, level + 1);
+        }
+    }
+    return clone;
+}
+
+void FlatInner::Build(BaseNode * node) {
+    cells_.clear();
+    if(FLAT_LEVELS == 0 || node->Leaf()) 
+        return;
+
+    // leave room for the clones appended by patches
+    int64_t size = Size((ROInner *) node, 1);
+    std::vector<Record>().swap(cells_);
+    cells_.reserve(size * 2);
+    Flatten((ROInner *) node, 1);
+}
+
+void FlatInner::Patch(BaseNode * node, _key_t k) {
+    ROInner * root = (ROInner *) node;
+    ROInner * clone = (ROInner *) Root();
+    if(Empty() || root->count < ROInner::BNODE_SIZE || clone->count < ROInner::BNODE_SIZE) {
+        Build(node); // a B-node shifts all of its slots
+        return;
+    }
+
+    // k went into or out of a bucket the walk from its prediction passes, or an inner node below it. 
+    // A removal may have emptied that bucket or moved its head past k, so the whole walk is refreshed
+    const int PROBE_SIZE = ROInner::PROBE_SIZE;
+    int last = root->Predict(k) / PROBE_SIZE, first = last;
+    while(root->recs[first * PROBE_SIZE].key > k) {
+        first = root->PrevOccupied(first);
+    }
+
+    int64_t size = 0;
+    Record * from = root->recs + first * PROBE_SIZE;
+    int slot_num = (last - first + 1) * PROBE_SIZE;
+    for(int j = 0; j < slot_num && FLAT_LEVELS > 1; j++) {
+        if(from[j].key != MAX_KEY && !((BaseNode *) from[j].val)->Leaf()) 
+            size += Size((ROInner *) from[j].val, 2);
+    }
+    if(cells_.size() + size > cells_.capacity()) {
+        Build(node); // out of room, rebuild to drop the stale clones
+        return;
+    }
+
+    // refresh the header, the buckets, and the error and bitmap behind the slots
+    Record * slots = clone->recs;
+    memcpy((void *)clone, root, sizeof(ROInner));
+    clone->recs = slots;
+    memcpy(slots + first * PROBE_SIZE, from, sizeof(Record) * slot_num);
+    *clone->WalkSum() = *root->WalkSum();
+    for(int w = first / 64; w <= last / 64; w++) {
+        clone->Occupied()[w] = root->Occupied()[w];
+    }
+
+    for(int j = 0; j < slot_num && FLAT_LEVELS > 1; j++) {
+        if(from[j].key != MAX_KEY && !((BaseNode *) from[j].val)->Leaf()) 
+            slots[first * PROBE_SIZE + j].val = Flatten((ROInner *) from[j].val, 2);
+    }
+}
+
 } // namespace morphtree
\ No newline at end of file
@@ -21,26 +21,26 @@ struct OFNode {
     
     OFNode(): len(0) {}
 
-    bool Store(_key_t k, _val_t v) {
-        if(recs_[len - 1].key == MAX_KEY) {
-            uint16_t i;
-            for(i = 0; i < len; i++) {
-                if(recs_[i].key >= k) {
-                    break;
-                }
+    // return 1 if k is inserted, 0 if its value is replaced, -1 if the node is full
+    int Store(_key_t k, _val_t v) {
+        uint16_t i;
+        for(i = 0; i < len; i++) {
+            if(recs_[i].key >= k) {
+                break;
             }
+        }
 
-            if(recs_[i].key == k) { // upsert 
-                recs_[i].val = v;
-                return true;
-            }
+        if(i < len && recs_[i].key == k) { // upsert 
+            recs_[i].val = v;
+            return 0;
+        }
 
+        if(recs_[len - 1].key == MAX_KEY) {
             memmove(&recs_[i + 1], &recs_[i], sizeof(Record) * (len - 1 - i));
             recs_[i] = Record(k, v);
-
-            return true;
+            return 1;
         } else {
-            return false;
+            return -1;
         }
     }
 
@@ -54,7 +54,7 @@ struct OFNode {
                 }
             }
 
-            if (recs_[i].key == k) {
+            if (i < len && recs_[i].key == k) {
                 v = recs_[i].val;
                 return true;
             } else {
@@ -82,8 +82,8 @@ struct OFNode {
             }
         }
 
-        if(recs_[i].key == k) {
-            memmove(&recs_[i], &recs_[i + 1], (len - i) * sizeof(Record));
+        if(i < len && recs_[i].key == k) {
+            memmove(&recs_[i], &recs_[i + 1], (len - 1 - i) * sizeof(Record));
             recs_[len - 1] = Record();
             return true;
         } else {
@@ -92,40 +92,161 @@ struct OFNode {
     }
 };
 
-ROLeaf::ROLeaf() {
+// Allocate an overflow node that holds up to len records
+static inline OFNode * NewOFNode(int len) {
+    OFNode * ofnode = (OFNode *) new char[sizeof(OFNode) + len * sizeof(Record)];
+    Record * _discard = new(ofnode->recs_) Record[len]; // just for initializition
+    ofnode->len = len;
+    return ofnode;
+}
+
+ROLeaf::ROLeaf() : ROLeaf(0) {}
+
+ROLeaf::ROLeaf(Record * recs_in, int num) : ROLeaf(recs_in, num, 0) {}
+
+ROLeaf::ROLeaf(WOLeaf * leaf) : ROLeaf(leaf, 0) {}
+
+ROLeaf::ROLeaf(int reserve) {
     node_type = ROLEAF;
     stats = ROSTATS;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
     of_count = 0;
     count = 0;
 
     slope = (double)(NODE_SIZE - 1) / MAX_KEY;
     intercept = 0;
-    recs = new Record[NODE_SIZE];
+    recs = new Record[NODE_SIZE + reserve];
 }
 
-ROLeaf::ROLeaf(Record * recs_in, int num) {
+ROLeaf::ROLeaf(Record * recs_in, int num, int reserve) {
     node_type = ROLEAF;
     stats = ROSTATS;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
     of_count = 0;
     count = 0;
 
     // caculate the linear model
     LinearModelBuilder model;
-    for(int i = num / 8; i < num * 7 / 8; i++) {
-        model.add(recs_in[i].key, i);
-    }
-    model.build();
+    model.build(recs_in, num / 8, num * 7 / 8);
 
     // caculate the linear model
     slope = model.a_ * NODE_SIZE / num;
     intercept = model.b_ * NODE_SIZE / num;
-    recs = new Record[NODE_SIZE];
+    recs = new Record[NODE_SIZE + reserve];
+
+    PlaceSorted(recs_in, num);
+}
+
+ROLeaf::ROLeaf(WOLeaf * leaf, int reserve) {
+    node_type = ROLEAF;
+    stats = ROSTATS;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
+    of_count = 0;
+    count = 0;
 
-    for(int i = 0; i < num; i++) {
-        this->Store(recs_in[i].key, recs_in[i].val, nullptr, nullptr);
+    Record * runs[WOLeaf::MAX_RUN_NUM];
+    int lens[WOLeaf::MAX_RUN_NUM];
+    int run_cnt = leaf->CollectRuns(runs, lens);
+
+    int num = 0;
+    for(int r = 0; r < run_cnt; r++) num += lens[r];
+
+    // train the model on sampled records, whose ranks are the sum of their positions in all runs
+    static const int SAMPLES = 128;
+    static const int MAX_SAMPLES = 2 * SAMPLES + WOLeaf::MAX_RUN_NUM; // step rounds down, each run adds one
+    _key_t keys[MAX_SAMPLES];
+    int ranks[MAX_SAMPLES];
+    int sample_num = 0;
+    int step = std::max(1, num / SAMPLES);
+    for(int r = 0; r < run_cnt; r++) {
+        for(int j = 0; j < lens[r]; j += step) {
+            _key_t k = runs[r][j].key;
+            int rank = 0;
+            for(int q = 0; q < run_cnt; q++) {
+                rank += std::lower_bound(runs[q], runs[q] + lens[q], runs[r][j]) - runs[q];
+            }
+            if(rank >= num / 8 && rank < num * 7 / 8) {
+                keys[sample_num] = k;
+                ranks[sample_num] = rank;
+                sample_num += 1;
+            }
+        }
+    }
+    if(num > 0) {
+        LinearModelBuilder model;
+        model.build(keys, ranks, sample_num);
+        slope = model.a_ * NODE_SIZE / num;
+        intercept = model.b_ * NODE_SIZE / num;
+    } else { // an emptied WOLeaf, take the model of an empty leaf
+        slope = (double)(NODE_SIZE - 1) / MAX_KEY;
+        intercept = 0;
+    }
+    recs = new Record[NODE_SIZE + reserve];
+
+    // merge the runs into a scratch buffer kept by the thread, and place them as sorted input. 
+    // On equal keys the older run goes first, so the newest version is kept
+    static thread_local std::vector<Record> merged;
+    merged.resize(num);
+    LoserTree tree(runs, nullptr, lens, run_cnt);
+    int live = 0;
+    while(!tree.Empty()) {
+        Record rec = tree.PopNewest();
+        if(rec.val != WOLeaf::Removed()) // removed in the WOLeaf
+            merged[live++] = rec;
+    }
+    PlaceSorted(merged.data(), live);
+}
+
+void ROLeaf::PlaceSorted(const Record * in, int num) {
+    int i = 0, bucket = num > 0 ? Predict(in[0].key) / PROBE_SIZE * PROBE_SIZE : 0;
+    while(i < num) {
+        int j = i + 1, distinct = 1, next_bucket = bucket;
+        for(; j < num; j++) {
+            next_bucket = Predict(in[j].key) / PROBE_SIZE * PROBE_SIZE;
+            if(next_bucket != bucket) break;
+            distinct += (in[j].key != in[j - 1].key);
+        }
+
+        OFNode * ofnode = nullptr;
+        if(distinct > PROBE_SIZE - 1) {
+            int of_len = 8;
+            while(of_len < distinct - (PROBE_SIZE - 1)) of_len *= 2;
+            ofnode = NewOFNode(of_len);
+            recs[bucket + PROBE_SIZE - 1].val = ofnode;
+            of_count += distinct - (PROBE_SIZE - 1);
+        }
+
+        Record * last = nullptr;
+        for(int pos = 0; i < j; i++) {
+            if(last != nullptr && last->key == in[i].key) { // upsert
+                last->val = in[i].val;
+                continue;
+            }
+            last = pos < PROBE_SIZE - 1 ? &recs[bucket + pos] : &ofnode->recs_[pos - (PROBE_SIZE - 1)];
+            *last = in[i];
+            pos += 1;
+        }
+
+        count += distinct;
+        bucket = next_bucket;
     }
 }
 
+int ROLeaf::Overflow(int b, Record ** of_recs) {
+    OFNode * ofnode = (OFNode *) recs[b + PROBE_SIZE - 1].val;
+    if(ofnode == nullptr) 
+        return 0;
+
+    *of_recs = ofnode->recs_;
+    return ofnode->len;
+}
+
 ROLeaf::~ROLeaf() {
     for(int i = 0; i < NODE_SIZE / PROBE_SIZE; i++) {
         if(recs[PROBE_SIZE * i + PROBE_SIZE - 1].val != nullptr){
@@ -161,10 +282,7 @@ bool ROLeaf::Store(_key_t k, _val_t v, _key_t * split_key, ROLeaf ** split_node)
         // no empty slot found
         OFNode * ofnode = (OFNode *) recs[predict + PROBE_SIZE - 1].val;
         if (ofnode == nullptr) {
-            ofnode = (OFNode *) new char[sizeof(OFNode) + 8 * sizeof(Record)];
-            Record * _discard = new(ofnode->recs_) Record[8]; // just for initializition
-
-            ofnode->len = 8;
+            ofnode = NewOFNode(8);
             recs[predict + PROBE_SIZE - 1].val = (_val_t) ofnode;
         }
 
@@ -176,22 +294,22 @@ bool ROLeaf::Store(_key_t k, _val_t v, _key_t * split_key, ROLeaf ** split_node)
         }
 
         // store the target record into overflow node
-        if(!ofnode->Store(k, v)) {
+        int ret = ofnode->Store(k, v);
+        if(ret == 0) { // upsert, k is already in the overflow node
+            return false;
+        } else if(ret < 0) {
             // the overflow node is full
             OFNode * old_ofnode = ofnode;
             
             // create a new overflow node, two times the formal one
-            int16_t newlen = old_ofnode->len * 2;
-            ofnode = (OFNode *) new char[sizeof(OFNode) + newlen * sizeof(Record)];
-            Record * _discard = new(ofnode->recs_) Record[newlen]; // just for initializition
+            ofnode = NewOFNode(old_ofnode->len * 2);
             
             // copy records into it
-            ofnode->len = newlen;
             memcpy(ofnode->recs_, old_ofnode->recs_, sizeof(Record) * old_ofnode->len);
             ofnode->Store(k, v);
             recs[predict + PROBE_SIZE - 1].val = (_val_t) ofnode;
 
-            delete old_ofnode;
+            delete [] (char *)old_ofnode;
         }
         of_count += 1;
     }
@@ -379,7 +497,7 @@ int ROLeaf::Scan(const _key_t &startKey, int len, Record *result) {
     else if(sibling == nullptr) 
         return cur;
     else
-        return cur + ((BaseNode *) sibling)->Scan(result[cur - 1].key, len - cur, result + cur);
+        return cur + ((BaseNode *) sibling)->Scan(cur > 0 ? result[cur - 1].key : startKey, len - cur, result + cur);
 }
 
 void ROLeaf::Dump(std::vector<Record> & out) {
@@ -396,6 +514,22 @@ void ROLeaf::Dump(std::vector<Record> & out) {
     }
 }
 
+int ROLeaf::Dump(Record * out) {
+    int cnt = 0;
+    for(int i = 0; i < NODE_SIZE; i++) {
+        if(recs[i].key != MAX_KEY) {
+            out[cnt++] = recs[i];
+        } else if(recs[i].val != nullptr) {
+            OFNode * ofnode = (OFNode *) recs[i].val;
+            for(int j = 0; j < ofnode->len && ofnode->recs_[j].key != MAX_KEY; j++) {
+                out[cnt++] = ofnode->recs_[j];
+            }
+        }
+    }
+
+    return cnt;
+}
+
 void ROLeaf::Print(string prefix) {
     std::vector<Record> out;
     Dump(out);
@@ -412,19 +546,17 @@ void ROLeaf::DoSplit(_key_t * split_key, ROLeaf ** split_node) {
     data.reserve(count);
     Dump(data);
     
-    int pid = getSubOptimalSplitkey(data.data(), data.size());
     // creat two new nodes
-    ROLeaf * left = new ROLeaf(data.data(), pid);
-    ROLeaf * right = new ROLeaf(data.data() + pid, data.size() - pid);
+    BaseNode * left, * right;
+    SplitLeaf(this, data, split_key, &left, &right);
     left->sibling = right;
     right->sibling = sibling;
 
     // update splitting info
-    *split_key = data[pid].key;
-    *split_node = right;
+    *split_node = (ROLeaf *) right;
 
     SwapNode(this, left);
-    delete left;
+    delete (ROLeaf *) left;
 }
 
 } // namespace morphtree
\ No newline at end of file
@@ -0,0 +1,205 @@
+/*
+    Copyright (c) Luo Yongping ypluo18@qq.com
+*/
+
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <immintrin.h>
+
+#include "node.h"
+
+namespace morphtree {
+
+// Probe the (unsorted) insert buffer with SIMD. Empty slots hold MAX_KEY,
+// and the buffer is always filled from the front. Return the slot of k or -1,
+// and the number of buffered records in count
+static inline int ProbeBuffer(Record * buf, _key_t k, int & count) {
+    static const int BUFFER_SIZE = RWLeaf::BUFFER_SIZE;
+    uint32_t hit = 0, used = 0;
+
+#ifdef __AVX2__
+    if constexpr (std::is_same<_key_t, double>::value && BUFFER_SIZE % 2 == 0) {
+        // each 256-bit lane holds two records: {key0, val0, key1, val1}
+        const __m256d target = _mm256_set1_pd(k);
+        const __m256d empty = _mm256_set1_pd(MAX_KEY);
+        for(int i = 0; i < BUFFER_SIZE; i += 2) {
+            __m256d two = _mm256_loadu_pd((const double *)&buf[i]);
+            int eq = _mm256_movemask_pd(_mm256_cmp_pd(two, target, _CMP_EQ_OQ));
+            int ne = _mm256_movemask_pd(_mm256_cmp_pd(two, empty, _CMP_NEQ_OQ));
+            hit  |= (uint32_t)((eq & 0x1) | ((eq >> 1) & 0x2)) << i;
+            used |= (uint32_t)((ne & 0x1) | ((ne >> 1) & 0x2)) << i;
+        }
+
+        count = __builtin_popcount(used);
+        return hit == 0 ? -1 : __builtin_ctz(hit);
+    }
+#endif
+
+    for(int i = 0; i < BUFFER_SIZE; i++) {
+        hit  |= (uint32_t)(buf[i].key == k) << i;
+        used |= (uint32_t)(buf[i].key != MAX_KEY) << i;
+    }
+
+    count = __builtin_popcount(used);
+    return hit == 0 ? -1 : __builtin_ctz(hit);
+}
+
+RWLeaf::RWLeaf() : ROLeaf(BUFFER_SIZE) {
+    node_type = RWLEAF;
+    stats = RWSTATS;
+}
+
+RWLeaf::RWLeaf(Record * recs_in, int num) : ROLeaf(recs_in, num, BUFFER_SIZE) {
+    node_type = RWLEAF;
+    stats = RWSTATS;
+}
+
+RWLeaf::RWLeaf(ROLeaf * leaf) : ROLeaf(BUFFER_SIZE) {
+    node_type = RWLEAF;
+    stats = RWSTATS;
+
+    slope = leaf->slope;
+    intercept = leaf->intercept;
+    of_count = leaf->of_count;
+    count = leaf->count;
+
+    // take over the buckets, the overflow nodes now belong to this node
+    memcpy(recs, leaf->recs, sizeof(Record) * NODE_SIZE);
+    for(int i = PROBE_SIZE - 1; i < NODE_SIZE; i += PROBE_SIZE) {
+        leaf->recs[i].val = nullptr;
+    }
+}
+
+RWLeaf::RWLeaf(WOLeaf * leaf) : ROLeaf(leaf, BUFFER_SIZE) {
+    node_type = RWLEAF;
+    stats = RWSTATS;
+}
+
+bool RWLeaf::Store(_key_t k, _val_t v, _key_t * split_key, RWLeaf ** split_node) {
+    Record * buf = recs + NODE_SIZE;
+    int buf_count;
+    int pos = ProbeBuffer(buf, k, buf_count);
+
+    if(pos >= 0) { // upsert
+        buf[pos].val = v;
+        return false;
+    }
+
+    buf[buf_count++] = Record(k, v);
+    // Scan and Dump drain the buffer with no chance to split, 
+    // so it is drained here as well once that could fill the leaf
+    if(buf_count < BUFFER_SIZE && count + buf_count < NODE_SIZE)
+        return false;
+
+    // the buffer is full, drain it into the buckets
+    Flush();
+    if(split_node != nullptr && ShouldSplit()) {
+        DoSplit(split_key, split_node);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool RWLeaf::Lookup(_key_t k, _val_t &v) {
+    Record * buf = recs + NODE_SIZE;
+    int buf_count;
+    int pos = ProbeBuffer(buf, k, buf_count);
+
+    if(pos >= 0) {
+        v = buf[pos].val;
+        return true;
+    } else {
+        return ROLeaf::Lookup(k, v);
+    }
+}
+
+bool RWLeaf::Update(const _key_t & k, _val_t v) {
+    Record * buf = recs + NODE_SIZE;
+    int buf_count;
+    int pos = ProbeBuffer(buf, k, buf_count);
+
+    if(pos >= 0) {
+        buf[pos].val = v;
+        return true;
+    } else {
+        return ROLeaf::Update(k, v);
+    }
+}
+
+bool RWLeaf::Remove(const _key_t & k) {
+    Record * buf = recs + NODE_SIZE;
+    int buf_count;
+    int pos = ProbeBuffer(buf, k, buf_count);
+
+    bool foundIf = false;
+    if(pos >= 0) { // fill the hole with the last buffered record
+        buf[pos] = buf[buf_count - 1];
+        buf[buf_count - 1] = Record();
+        foundIf = true;
+    }
+
+    // an older version might still reside in the buckets
+    return ROLeaf::Remove(k) || foundIf;
+}
+
+int RWLeaf::Scan(const _key_t &startKey, int len, Record *result) {
+    Flush();
+    return ROLeaf::Scan(startKey, len, result);
+}
+
+void RWLeaf::Dump(std::vector<Record> & out) {
+    Flush();
+    ROLeaf::Dump(out);
+}
+
+int RWLeaf::Count() {
+    int buf_count;
+    ProbeBuffer(recs + NODE_SIZE, MAX_KEY, buf_count);
+    return count + buf_count;
+}
+
+void RWLeaf::Flush() {
+    Record * buf = recs + NODE_SIZE;
+    int buf_count;
+    ProbeBuffer(buf, MAX_KEY, buf_count);
+    if(buf_count == 0) return;
+
+    // drain in key order, so that neighbouring records land in neighbouring buckets
+    std::sort(buf, buf + buf_count);
+    for(int i = 0; i < buf_count; i++) {
+        ROLeaf::Store(buf[i].key, buf[i].val, nullptr, nullptr);
+        buf[i] = Record();
+    }
+}
+
+void RWLeaf::Print(string prefix) {
+    Record * buf = recs + NODE_SIZE;
+    int buf_count;
+    ProbeBuffer(buf, MAX_KEY, buf_count);
+
+    printf("%s(%d, %d)[(%f)", prefix.c_str(), node_type, buf_count, (float)of_count / count);
+    printf("]\n");
+}
+
+void RWLeaf::DoSplit(_key_t * split_key, RWLeaf ** split_node) {
+    std::vector<Record> data;
+    data.reserve(count + BUFFER_SIZE);
+    Dump(data);
+    
+    // creat two new nodes
+    BaseNode * left, * right;
+    SplitLeaf(this, data, split_key, &left, &right);
+    left->sibling = right;
+    right->sibling = sibling;
+
+    // update splitting info
+    *split_node = (RWLeaf *) right;
+
+    SwapNode(this, left);
+    delete (RWLeaf *) left;
+}
+
+} // namespace morphtree
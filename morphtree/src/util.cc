@@ -1,7 +1,181 @@
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <immintrin.h>
 #include "../include/util.h"
 
+#ifdef __AVX2__
+// the keys of recs[0, 4) in the order {0, 2, 1, 3}
+static inline __m256d LoadKeys(const Record * recs) {
+    __m256d lo = _mm256_loadu_pd((const double *)recs);       // {k0, v0, k1, v1}
+    __m256d hi = _mm256_loadu_pd((const double *)(recs + 2)); // {k2, v2, k3, v3}
+    return _mm256_unpacklo_pd(lo, hi);
+}
+
+// compensated summation in each lane, sum - comp tracks the exact total
+static inline void KahanAdd(__m256d & sum, __m256d & comp, __m256d v) {
+    __m256d y = _mm256_sub_pd(v, comp);
+    __m256d t = _mm256_add_pd(sum, y);
+    comp = _mm256_sub_pd(_mm256_sub_pd(t, sum), y);
+    sum = t;
+}
+#endif
+
+static inline void KahanAdd(double & sum, double & comp, double v) {
+    double y = v - comp;
+    double t = sum + y;
+    comp = (t - sum) - y;
+    sum = t;
+}
+
+#ifdef __AVX2__
+// records summed plainly in the lanes before the block sum is added with compensation, 
+// so the rounding error grows with the block instead of the node
+static const int SUM_BLOCK = 64;
+
+// fold the compensated lanes into a compensated scalar sum
+static inline void KahanFold(__m256d sum, __m256d comp, double & s, double & c) {
+    alignas(32) double ls[4], lc[4];
+    _mm256_store_pd(ls, sum);
+    _mm256_store_pd(lc, comp);
+    for (int j = 0; j < 4; j++) {
+        KahanAdd(s, c, ls[j] - lc[j]);
+    }
+}
+#endif
+
+void LinearModelBuilder::build(const Record * recs, int first, int last) {
+    int n = last - first;
+    if (n <= 1) {
+        a_ = 0;
+        b_ = n == 1 ? first : 0;
+        return;
+    }
+
+    // the mean key, summed relative to the first key to keep the sums small
+    const double x0 = recs[first].key;
+    double x_sum = 0, x_comp = 0;
+    int i = first;
+#ifdef __AVX2__
+    if constexpr (std::is_same<_key_t, double>::value && sizeof(Record) == 2 * sizeof(double)) {
+        const __m256d base = _mm256_set1_pd(x0);
+        __m256d acc = _mm256_setzero_pd(), comp = _mm256_setzero_pd();
+        for (; i + 4 <= last; ) {
+            __m256d block = _mm256_setzero_pd();
+            for (int end = std::min(i + SUM_BLOCK, last - 3); i < end; i += 4) {
+                block = _mm256_add_pd(block, _mm256_sub_pd(LoadKeys(recs + i), base));
+            }
+            KahanAdd(acc, comp, block);
+        }
+        KahanFold(acc, comp, x_sum, x_comp);
+    }
+#endif
+    for (; i < last; i++) {
+        KahanAdd(x_sum, x_comp, static_cast<double>(recs[i].key) - x0);
+    }
+    const double x_mean = x0 + (x_sum - x_comp) / n;
+    const double y_mean = first + (n - 1) / 2.0;
+
+    // the co-moments of the centered keys and positions
+    double xx_sum = 0, xx_comp = 0, xy_sum = 0, xy_comp = 0;
+    i = first;
+#ifdef __AVX2__
+    if constexpr (std::is_same<_key_t, double>::value && sizeof(Record) == 2 * sizeof(double)) {
+        const __m256d mean = _mm256_set1_pd(x_mean);
+        const __m256d four = _mm256_set1_pd(4);
+        __m256d y = _mm256_setr_pd(first - y_mean, first + 2 - y_mean, first + 1 - y_mean, first + 3 - y_mean);
+        __m256d xx_acc = _mm256_setzero_pd(), xy_acc = _mm256_setzero_pd();
+        __m256d xx_c = _mm256_setzero_pd(), xy_c = _mm256_setzero_pd();
+        for (; i + 4 <= last; ) {
+            __m256d xx_block = _mm256_setzero_pd(), xy_block = _mm256_setzero_pd();
+            for (int end = std::min(i + SUM_BLOCK, last - 3); i < end; i += 4) {
+                __m256d x = _mm256_sub_pd(LoadKeys(recs + i), mean);
+                xx_block = _mm256_add_pd(xx_block, _mm256_mul_pd(x, x));
+                xy_block = _mm256_add_pd(xy_block, _mm256_mul_pd(x, y));
+                y = _mm256_add_pd(y, four);
+            }
+            KahanAdd(xx_acc, xx_c, xx_block);
+            KahanAdd(xy_acc, xy_c, xy_block);
+        }
+        KahanFold(xx_acc, xx_c, xx_sum, xx_comp);
+        KahanFold(xy_acc, xy_c, xy_sum, xy_comp);
+    }
+#endif
+    for (; i < last; i++) {
+        double x = static_cast<double>(recs[i].key) - x_mean;
+        KahanAdd(xx_sum, xx_comp, x * x);
+        KahanAdd(xy_sum, xy_comp, x * (i - y_mean));
+    }
+    xx_sum -= xx_comp;
+    xy_sum -= xy_comp;
+
+    if (xx_sum == 0) {
+        // all values in a bucket have the same key.
+        a_ = 0;
+        b_ = y_mean;
+        return;
+    }
+
+    a_ = xy_sum / xx_sum;
+    b_ = y_mean - a_ * x_mean;
+
+    // If floating point precision errors, fit spline
+    if (a_ <= 0) {
+        a_ = (n - 1) / (static_cast<double>(recs[last - 1].key) - static_cast<double>(recs[first].key));
+        b_ = first - static_cast<double>(recs[first].key) * a_;
+    }
+}
+
+void LinearModelBuilder::build(const _key_t * xs, const int * ys, int n) {
+    if (n <= 1) {
+        a_ = 0;
+        b_ = n == 1 ? ys[0] : 0;
+        return;
+    }
+
+    // the means, the keys summed relative to the first one
+    const double x0 = xs[0];
+    double x_sum = 0, x_comp = 0, y_sum = 0, y_comp = 0;
+    double x_min = x0, x_max = x0, y_min = ys[0], y_max = ys[0];
+    for (int i = 0; i < n; i++) {
+        KahanAdd(x_sum, x_comp, static_cast<double>(xs[i]) - x0);
+        KahanAdd(y_sum, y_comp, ys[i]);
+        x_min = std::min<double>(x_min, xs[i]);
+        x_max = std::max<double>(x_max, xs[i]);
+        y_min = std::min<double>(y_min, ys[i]);
+        y_max = std::max<double>(y_max, ys[i]);
+    }
+    const double x_mean = x0 + (x_sum - x_comp) / n;
+    const double y_mean = (y_sum - y_comp) / n;
+
+    double xx_sum = 0, xx_comp = 0, xy_sum = 0, xy_comp = 0;
+    for (int i = 0; i < n; i++) {
+        double x = static_cast<double>(xs[i]) - x_mean;
+        KahanAdd(xx_sum, xx_comp, x * x);
+        KahanAdd(xy_sum, xy_comp, x * (ys[i] - y_mean));
+    }
+    xx_sum -= xx_comp;
+    xy_sum -= xy_comp;
+
+    if (xx_sum == 0) {
+        // all values in a bucket have the same key.
+        a_ = 0;
+        b_ = y_mean;
+        return;
+    }
+
+    a_ = xy_sum / xx_sum;
+    b_ = y_mean - a_ * x_mean;
+
+    // If floating point precision errors, fit spline
+    if (a_ <= 0) {
+        a_ = (y_max - y_min) / (x_max - x_min);
+        b_ = y_min - x_min * a_;
+    }
+}
+
 bool BinSearch(Record * recs, int len, _key_t k, _val_t &v) { // do binary search
     if (len == 0) return false;
 
@@ -61,7 +235,10 @@ bool BinSearch_CallBack(Record * recs, int len, _key_t k, std::function<bool(Rec
     return false; 
 }
 
-bool ExpSearch(Record * recs, int len, int predict, _key_t k, _val_t &v) {  
+// Narrow the search for k down from the predicted position by exponential steps, 
+// return the first position of the window that may hold k and its length in win_len, 
+// or -1 if k is not in recs
+static inline int ExpWindow(Record * recs, int len, int predict, _key_t k, int & win_len) {
     assert(predict >= 0 && predict <= len - 1);
 
     int cur = predict;
@@ -75,13 +252,11 @@ bool ExpSearch(Record * recs, int len, int predict, _key_t k, _val_t &v) {
         
         // cur is less than 0 or recs[cur] <= k
         cur = std::max(0, cur);
-        if(recs[cur].key <= k)
-            return BinSearch(recs + cur, predict - cur + 1, k, v);
-        else
-            return false;
+        win_len = predict - cur + 1;
+        return recs[cur].key <= k ? cur : -1;
     } else if(recs[predict].key == k) {
-        v = recs[predict].val;
-        return true;
+        win_len = 1;
+        return predict;
     } else { // go right
         int step = 16;
         while(cur < len && recs[cur].key < k) {
@@ -92,11 +267,62 @@ bool ExpSearch(Record * recs, int len, int predict, _key_t k, _val_t &v) {
         
         // cur is larger than len - 1 or recs[cur] > k
         cur = std::min(len - 1, cur);
-        if(recs[cur].key >= k)
-            return BinSearch(recs + predict, cur - predict + 1, k, v);
-        else
-            return false;
+        win_len = cur - predict + 1;
+        return recs[cur].key >= k ? predict : -1;
+    }
+}
+
+bool ExpSearch(Record * recs, int len, int predict, _key_t k, _val_t &v) {  
+    int win_len, start = ExpWindow(recs, len, predict, k, win_len);
+    return start >= 0 && BinSearch(recs + start, win_len, k, v);
+}
+
+bool ExpSearch_CallBack(Record * recs, int len, int predict, _key_t k, std::function<bool(Record &)> func) {  
+    int win_len, start = ExpWindow(recs, len, predict, k, win_len);
+    return start >= 0 && BinSearch_CallBack(recs + start, win_len, k, func);
+}
+
+Record * ExpSearch_Find(Record * recs, int len, int predict, _key_t k) {
+    int win_len, start = ExpWindow(recs, len, predict, k, win_len);
+    if(start < 0) 
+        return nullptr;
+
+    int pos = start + BinSearch_Locate(recs + start, win_len, k);
+    return pos < start + win_len && recs[pos].key == k ? recs + pos : nullptr;
+}
+
+Record * LockstepSearch(Record ** runs, int * lens, int n, _key_t k) {
+    static const int MAX_RUNS = 64;
+    assert(n <= MAX_RUNS);
+
+    Record * base[MAX_RUNS];
+    int len[MAX_RUNS];
+    int longest = 0;
+    for(int i = 0; i < n; i++) {
+        assert(lens[i] > 0);
+        base[i] = runs[i];
+        len[i] = lens[i];
+        longest = std::max(longest, len[i]);
+    }
+
+    // every round halves each window, base ends at the last record not larger than k. 
+    // A finished search keeps len 1 and half 0, which leaves it where it is
+    while(longest > 1) {
+        longest = 0;
+        for(int i = 0; i < n; i++) {
+            int half = len[i] / 2, rest = len[i] - half;
+            __builtin_prefetch(base[i] + rest / 2);
+            __builtin_prefetch(base[i] + half + rest / 2);
+            base[i] += (base[i][half].key <= k) * half; // a select the compiler keeps branch-free
+            len[i] = rest;
+            longest = std::max(longest, rest);
+        }
+    }
+
+    for(int i = 0; i < n; i++) {
+        if(base[i]->key == k) return base[i];
     }
+    return nullptr;
 }
 
 _key_t GetMedian(std::vector<_key_t> & medians) {
@@ -117,130 +343,203 @@ _key_t GetMedian(std::vector<_key_t> & medians) {
     return q.top();
 }
 
-void TwoWayMerge(Record * a, Record * b, int lena, int lenb, std::vector<Record> & out) {
-    int cura = 0;
-    int curb = 0;
-
-    while(cura < lena && curb < lenb) {
-        if(a[cura].key < b[curb].key) {
-            out.push_back(a[cura++]);
-        } else if(a[cura].key > b[curb].key) {
-            out.push_back(b[curb++]);
-        } else {
-            out.push_back(a[cura++]);
-            out.push_back(b[curb++]);
+// the bits of a double key as an unsigned integer that sorts in the same order
+static inline uint64_t OrderedBits(double k) {
+    uint64_t bits;
+    memcpy(&bits, &k, sizeof(bits));
+    return bits ^ ((uint64_t)((int64_t)bits >> 63) | (1ull << 63));
+}
+
+static inline void InsertionSort(Record * recs, int num) {
+    for(int i = 1; i < num; i++) {
+        Record tmp = recs[i];
+        int j = i;
+        while(j > 0 && recs[j - 1].key > tmp.key) {
+            recs[j] = recs[j - 1];
+            j -= 1;
         }
+        recs[j] = tmp;
     }
-
-    while(cura < lena)
-        out.push_back(a[cura++]);
-
-    while(curb < lenb)
-        out.push_back(b[curb++]);
 }
 
-void KWayMerge(Record ** runs, int * run_lens, int k, std::vector<Record> & out) {
-    struct HeapEle {
-        int run_id;
-        Record val;
-
-        bool operator < (const HeapEle & oth) const {
-            return val > oth.val; // this will make a min heap
-        }
-    };
+void SortRecords(Record * recs, int num) {
+    if constexpr (!std::is_same<_key_t, double>::value) {
+        std::stable_sort(recs, recs + num, [](const Record & a, const Record & b) { return a.key < b.key; });
+        return;
+    }
 
-    int * run_idxs = new int[k];
-    std::priority_queue<HeapEle, std::vector<HeapEle>> q; // min heap
+    if(num <= 32) {
+        InsertionSort(recs, num);
+        return;
+    }
 
-    for(int i = 0; i < k; i++) {
-        if(run_lens[i] > 0)
-            q.push({i, runs[i][0]});
-        run_idxs[i] = 1;
+    // one MSD radix pass on the bits that vary among the keys, which leaves 
+    // about one record per bucket
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for(int i = 0; i < num; i++) {
+        uint64_t bits = OrderedBits(recs[i].key);
+        lo = std::min(lo, bits);
+        hi = std::max(hi, bits);
     }
+    if(lo == hi) return; // all keys are equal
 
-    while(!q.empty()) {
-        HeapEle e = q.top(); q.pop();
+    static const int MAX_BUCKETS = 2048;
+    int buckets = 1, shift = 0;
+    while(buckets < num && buckets < MAX_BUCKETS) buckets *= 2;
+    while(((hi - lo) >> shift) >= (uint64_t)buckets) shift++;
 
-        out.push_back(e.val);
-        int & cur_pos = run_idxs[e.run_id];
-        if (cur_pos < run_lens[e.run_id]) {
-            q.push({e.run_id, runs[e.run_id][cur_pos++]});
-        }
+    uint32_t bounds[MAX_BUCKETS + 1];
+    memset(bounds, 0, sizeof(uint32_t) * buckets);
+    for(int i = 0; i < num; i++) {
+        bounds[(OrderedBits(recs[i].key) - lo) >> shift] += 1;
+    }
+    for(int b = 1; b < buckets; b++) {
+        bounds[b] += bounds[b - 1];
+    }
+    bounds[buckets] = num;
+
+    // scatter backwards to keep equal keys in order, bounds[b] ends up at the start of bucket b
+    static thread_local std::vector<Record> scratch;
+    if((int)scratch.size() < num) scratch.resize(num);
+    for(int i = num - 1; i >= 0; i--) {
+        scratch[--bounds[(OrderedBits(recs[i].key) - lo) >> shift]] = recs[i];
+    }
+    memcpy(recs, scratch.data(), sizeof(Record) * num);
+
+    // finish the buckets, a crowded one is sorted again on its own, narrower range of bits
+    for(int b = 0; b < buckets; b++) {
+        int len = bounds[b + 1] - bounds[b];
+        if(len > 32) 
+            SortRecords(recs + bounds[b], len);
+        else if(len > 1)
+            InsertionSort(recs + bounds[b], len);
     }
 }
 
-extern int KWayScan(Record ** runs, int * run_lens, int k, _key_t startKey, int len, Record * out) {
-    struct HeapEle {
-        int run_id;
-        Record ele;
+// Merge two sorted runs into out and stop after limit records, a on equal keys goes first. 
+// The loop picks each record without a branch on the keys, which a merge cannot predict
+static int MergeTwo(Record * a, int lena, Record * b, int lenb, Record * out, int limit) {
+    int cura = 0, curb = 0, cur = 0;
+    limit = std::min(limit, lena + lenb);
+
+    while(cura < lena && curb < lenb && cur < limit) {
+        bool take_b = b[curb].key < a[cura].key;
+        out[cur++] = take_b ? b[curb] : a[cura];
+        curb += take_b;
+        cura += !take_b;
+    }
 
-        bool operator < (const HeapEle & oth) const {
-            return ele > oth.ele; // this will make a min heap
-        }
-    };
+    int rest = limit - cur;
+    if(cura < lena) {
+        memcpy(out + cur, a + cura, sizeof(Record) * std::min(rest, lena - cura));
+    } else if(curb < lenb) {
+        memcpy(out + cur, b + curb, sizeof(Record) * std::min(rest, lenb - curb));
+    }
+    return limit;
+}
 
-    int * run_idxs = new int[k];
-    std::priority_queue<HeapEle, std::vector<HeapEle>> q; // min heap
+LoserTree::LoserTree(Record ** runs, const int * starts, const int * ends, int k) {
+    assert(k <= MAX_WAYS);
+    runs_ = runs;
+    ways_ = 1;
+    while(ways_ < k) ways_ *= 2;
 
-    // locate the starting point of each scan
-    for(int i = 0; i < k; i++) {
-        run_idxs[i] = BinSearch_Locate(runs[i], run_lens[i], startKey);
+    for(int i = 0; i < ways_; i++) {
+        pos_[i] = i < k && starts != nullptr ? starts[i] : 0;
+        ends_[i] = i < k ? ends[i] : 0;
+        keys_[i] = pos_[i] < ends_[i] ? runs[i][pos_[i]].key : MAX_KEY;
     }
 
-    // start merge scan
-    for(int i = 0; i < k; i++) {
-        int & run_pos = run_idxs[i];
-        if(run_pos < run_lens[i])
-            q.push({i, runs[i][run_pos++]});
+    // play the matches bottom-up, the winners climb and the losers stay
+    int winners[2 * MAX_WAYS];
+    for(int i = 0; i < ways_; i++) {
+        winners[ways_ + i] = i;
     }
+    for(int n = ways_ - 1; n > 0; n--) {
+        int l = winners[2 * n], r = winners[2 * n + 1];
+        bool left_wins = Beats(l, r);
+        winners[n] = left_wins ? l : r;
+        losers_[n] = left_wins ? r : l;
+    }
+    winner_ = winners[1];
+}
 
+int LoserTree::Drain(Record * out, int limit, bool nodup) {
     int cur = 0;
-    while(!q.empty() && cur < len) {
-        HeapEle e = q.top(); q.pop();
-
-        out[cur++] = e.ele;
-        int & run_pos = run_idxs[e.run_id];
-        if (run_pos < run_lens[e.run_id]) {
-            q.push({e.run_id, runs[e.run_id][run_pos++]});
+    while(cur < limit && !Empty()) {
+        if(nodup) {
+            out[cur++] = PopNewest();
+        } else {
+            out[cur++] = Top();
+            Pop();
         }
     }
-
     return cur;
 }
 
-void KWayMerge_nodup(Record ** runs, int * run_lens, int k, std::vector<Record> & out) {
-    struct HeapEle {
-        int run_id;
-        Record val;
+void TwoWayMerge(Record * a, Record * b, int lena, int lenb, std::vector<Record> & out) {
+    size_t base = out.size();
+    out.resize(base + lena + lenb);
+    MergeTwo(a, lena, b, lenb, out.data() + base, lena + lenb);
+}
 
-        bool operator < (const HeapEle & oth) const {
-            return val > oth.val; // this will make a min heap
-        }
-    };
+int KWayMerge(Record ** runs, int * run_lens, int k, Record * out) {
+    int total = 0;
+    for(int i = 0; i < k; i++) total += run_lens[i];
+
+    if(k == 1) {
+        memcpy(out, runs[0], sizeof(Record) * total);
+        return total;
+    } else if(k == 2) {
+        return MergeTwo(runs[0], run_lens[0], runs[1], run_lens[1], out, total);
+    } else {
+        LoserTree tree(runs, nullptr, run_lens, k);
+        return tree.Drain(out, total);
+    }
+}
+
+void KWayMerge(Record ** runs, int * run_lens, int k, std::vector<Record> & out) {
+    int total = 0;
+    for(int i = 0; i < k; i++) total += run_lens[i];
 
-    int * run_idxs = new int[k];
-    std::priority_queue<HeapEle, std::vector<HeapEle>> q; // min heap
+    size_t base = out.size();
+    out.resize(base + total);
+    KWayMerge(runs, run_lens, k, out.data() + base);
+}
 
+int KWayScan(Record ** runs, int * run_lens, int k, _key_t startKey, int len, Record * out) {
+    // locate the starting point of each scan
+    int starts[LoserTree::MAX_WAYS];
     for(int i = 0; i < k; i++) {
-        if(run_lens[i] > 0)
-            q.push({i, runs[i][0]});
-        run_idxs[i] = 1;
-    }
-
-    _key_t last_k = MAX_KEY;
-    while(!q.empty()) {
-        HeapEle e = q.top(); q.pop();
-        if(e.val.key != last_k)
-            out.push_back(e.val);
-        int & cur_pos = run_idxs[e.run_id];
-        if (cur_pos < run_lens[e.run_id]) {
-            q.push({e.run_id, runs[e.run_id][cur_pos++]});
-        }
+        starts[i] = run_lens[i] > 0 ? BinSearch_Locate(runs[i], run_lens[i], startKey) : 0;
+    }
 
-        last_k = e.val.key;
+    if(k == 2) {
+        return MergeTwo(runs[0] + starts[0], run_lens[0] - starts[0], 
+                        runs[1] + starts[1], run_lens[1] - starts[1], out, len);
+    } else {
+        LoserTree tree(runs, starts, run_lens, k);
+        return tree.Drain(out, len);
     }
 }
 
+int KWayMerge_nodup(Record ** runs, int * run_lens, int k, Record * out) {
+    int total = 0;
+    for(int i = 0; i < k; i++) total += run_lens[i];
+
+    LoserTree tree(runs, nullptr, run_lens, k);
+    return tree.Drain(out, total, true);
+}
+
+void KWayMerge_nodup(Record ** runs, int * run_lens, int k, std::vector<Record> & out) {
+    int total = 0;
+    for(int i = 0; i < k; i++) total += run_lens[i];
+
+    size_t base = out.size();
+    out.resize(base + total);
+    out.resize(base + KWayMerge_nodup(runs, run_lens, k, out.data() + base));
+}
+
 int getSubOptimalSplitkey(Record * recs, int num) {
     static const int PIVOT_NUM = 32;
     _key_t min_pivot = recs[0].key;
@@ -14,22 +14,51 @@ namespace morphtree {
 WOLeaf::WOLeaf() {
     node_type = NodeType::WOLEAF;
     stats = WOSTATS;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
 
-    recs = new Record[NODE_SIZE];
+    recs = new Record[NODE_SIZE + EXT_SLOTS];
     inital_count = 0;
     insert_count = 0;
-    swap_pos = inital_count;
+    remove_count = 0;
+    lower = MAX_KEY;
+    upper = MIN_KEY;
+    InitialModel()->Train(recs, inital_count);
 }
 
 WOLeaf::WOLeaf(Record * recs_in, int num) {
     node_type = NodeType::WOLEAF;
     stats = WOSTATS;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
 
-    recs = new Record[NODE_SIZE];
+    recs = new Record[NODE_SIZE + EXT_SLOTS];
     memcpy(recs, recs_in, sizeof(Record) * num);
     inital_count = num;
     insert_count = 0;
-    swap_pos = inital_count;
+    remove_count = 0;
+    lower = num > 0 ? recs[0].key : MAX_KEY;
+    upper = num > 0 ? recs[num - 1].key : MIN_KEY;
+    InitialModel()->Train(recs, inital_count);
+}
+
+WOLeaf::WOLeaf(ROLeaf * leaf) {
+    assert(leaf->Count() < NODE_SIZE); // MorphNode keeps fuller leaves
+    node_type = NodeType::WOLEAF;
+    stats = WOSTATS;
+    lock = 0;
+    memset(heat, 0, sizeof(heat));
+    sibling = nullptr;
+
+    recs = new Record[NODE_SIZE + EXT_SLOTS];
+    inital_count = leaf->Dump(recs);
+    insert_count = 0;
+    remove_count = 0;
+    lower = inital_count > 0 ? recs[0].key : MAX_KEY;
+    upper = inital_count > 0 ? recs[inital_count - 1].key : MIN_KEY;
+    InitialModel()->Train(recs, inital_count);
 }
 
 WOLeaf::~WOLeaf() {
@@ -37,190 +66,251 @@ WOLeaf::~WOLeaf() {
 }
 
 bool WOLeaf::Store(_key_t k, _val_t v, _key_t * split_key, WOLeaf ** split_node) {
+    // the newest version of a key wins: one in the unsorted tail is overwritten in place, 
+    // otherwise the record is appended and shadows the versions in older runs
+    int pos = ProbeTail(k);
+    if(pos >= 0) {
+        Record & r = recs[inital_count + insert_count / PIECE_SIZE * PIECE_SIZE + pos];
+        if(r.val == Removed()) remove_count -= 1;
+        r.val = v;
+        return false;
+    }
+
+    PieceFilter & filter = Filters()[insert_count / PIECE_SIZE];
+    if(insert_count % PIECE_SIZE == 0) {
+        filter.Reset();
+        memset(TailTable(), 0, sizeof(TailSlot) * TAIL_SLOTS);
+    }
+    filter.Add(k);
+    IndexTail(k, insert_count % PIECE_SIZE);
+
     recs[inital_count + insert_count++] = {k, v};
+    lower = std::min(lower, k);
+    upper = std::max(upper, k);
 
     if(insert_count % PIECE_SIZE == 0) {
         int16_t start = insert_count - PIECE_SIZE;
-        std::sort(recs + inital_count + start, recs + inital_count + insert_count);
-        swap_pos = inital_count + insert_count;
+        SortRecords(recs + inital_count + start, PIECE_SIZE);
+        filter.model.Train(recs + inital_count + start, PIECE_SIZE);
     }
     
-    if(inital_count + insert_count == GLOBAL_LEAF_SIZE) {
-        DoSplit(split_key, split_node);
+    if(inital_count + insert_count >= GLOBAL_LEAF_SIZE) {
+        // removed records and older versions take room as well: merge the runs once, 
+        // keep the merged run if that reclaimed enough room, split it otherwise
+        std::vector<Record> merged;
+        merged.reserve(GLOBAL_LEAF_SIZE);
+        Dump(merged);
+        if(merged.size() <= RECLAIM_FILL) {
+            Compact(merged);
+            return false;
+        }
+
+        reclaimed_bytes += sizeof(Record) * (GLOBAL_LEAF_SIZE - merged.size());
+        DoSplit(merged, split_key, split_node);
         return true;
     } else {
+        // enough sorted pieces have gathered, and the leaf is not about to split
+        if(COMPACT_PIECES > 0 && insert_count == COMPACT_PIECES * PIECE_SIZE) 
+            Compact();
         return false;
     }
 }
 
-bool WOLeaf::Lookup(_key_t k, _val_t &v) {
-    // do binary search in all sorted runs
-    if(BinSearch(recs, inital_count, k, v)) {
-        return true;
-    }
-
+Record * WOLeaf::FindNewest(_key_t k) {
+    // the unsorted tail holds the newest records
     int16_t bin_end = insert_count / PIECE_SIZE * PIECE_SIZE;
-    for(int i = inital_count; i < inital_count + bin_end; i += PIECE_SIZE) {
-        if(BinSearch(recs + i, PIECE_SIZE, k, v)) {
-            return true;
-        }
+    int pos = ProbeTail(k);
+    if(pos >= 0) 
+        return &recs[inital_count + bin_end + pos];
+
+    // then the sorted pieces from the newest one, skipping those whose filters rule k out. 
+    // When false positives admit several pieces, the windows their models predict are searched all at once
+    PieceFilter * filters = Filters();
+    int admitted[MAX_RUN_NUM];
+    int adm_cnt = 0;
+    for(int p = bin_end / PIECE_SIZE - 1; p >= 0; p--) {
+        if(filters[p].MayContain(k)) 
+            admitted[adm_cnt++] = p;
     }
 
-    // do scan in unsorted runs
-    for(int i = inital_count + bin_end; i < inital_count + insert_count; i++) {
-        if(recs[i].key == k) {
-            v = recs[i].val;
-            if(i - inital_count - bin_end > 64) 
-                std::swap(recs[swap_pos++], recs[i]); // bubble the record to the front of unsorted run
-            return true;
+    Record * r = nullptr;
+    if(adm_cnt == 1) {
+        int p = admitted[0];
+        r = ExpSearch_Find(recs + inital_count + p * PIECE_SIZE, PIECE_SIZE, filters[p].model.Predict(k, PIECE_SIZE), k);
+    } else if(adm_cnt > 1) {
+        Record * wins[MAX_RUN_NUM];
+        int win_lens[MAX_RUN_NUM];
+        for(int i = 0; i < adm_cnt; i++) {
+            int p = admitted[i];
+            wins[i] = filters[p].model.Window(recs + inital_count + p * PIECE_SIZE, PIECE_SIZE, k, win_lens[i]);
         }
+        r = LockstepSearch(wins, win_lens, adm_cnt, k);
     }
+    if(r != nullptr) 
+        return r;
 
-    return false;
+    if(inital_count > 0) 
+        return ExpSearch_Find(recs, inital_count, InitialModel()->Predict(k, inital_count), k);
+    return nullptr;
 }
 
-bool WOLeaf::Update(const _key_t & k, _val_t v) {
-    auto binary_update = [&v](Record & r) {
-        r.val = v;
-        return true;
-    };
-
-    // do binary update in all sorted runs
-    if(BinSearch_CallBack(recs, inital_count, k, binary_update)) {
-        return true;
-    }
+bool WOLeaf::Lookup(_key_t k, _val_t &v) {
+    Record * r = FindNewest(k);
+    if(r == nullptr || r->val == Removed()) // a removed record hides its older versions
+        return false;
 
-    int16_t bin_end = insert_count / PIECE_SIZE * PIECE_SIZE;
-    for(int i = inital_count; i < inital_count + bin_end; i += PIECE_SIZE) {
-        if(BinSearch_CallBack(recs + i, PIECE_SIZE, k, binary_update)) {
-            return true;
-        }
-    }
+    v = r->val;
+    return true;
+}
 
-    // do scan in unsorted runs
-    for(int i = inital_count + bin_end; i < inital_count + insert_count; i++) {
-        if(recs[i].key == k) {
-            recs[i].val = v;
-            if(i - inital_count - bin_end > 64) 
-                std::swap(recs[swap_pos++], recs[i]); // bubble the record to the front of unsorted run
-            return true;
-        }
-    }
+bool WOLeaf::Update(const _key_t & k, _val_t v) {
+    Record * r = FindNewest(k);
+    if(r == nullptr || r->val == Removed()) 
+        return false;
 
-    return false;
+    r->val = v;
+    return true;
 }
 
 bool WOLeaf::Remove(const _key_t & k) {
-    auto binary_remove = [](Record & r) {
-        if(r.val == 0) {
-            return false;
-        } else {
-            r.val = 0;
-            return true;
-        }
-    };
-
-    // do binary update in all sorted runs
-    if(BinSearch_CallBack(recs, inital_count, k, binary_remove)) {
-        return true;
-    }
-
-    int16_t bin_end = insert_count / PIECE_SIZE * PIECE_SIZE;
-    for(int i = inital_count; i < bin_end; i += PIECE_SIZE) {
-        if(BinSearch_CallBack(recs + i, PIECE_SIZE, k, binary_remove)) {
-            return true;
-        }
-    }
-
-    // do scan in unsorted runs
-    for(int i = inital_count + bin_end; i < insert_count; i++) {
-        if(recs[i].key == k) {
-            recs[i].val = 0;
-            return true;
-        }
-    }
+    Record * r = FindNewest(k);
+    if(r == nullptr || r->val == Removed()) 
+        return false;
 
-    return false;
+    r->val = Removed();
+    remove_count += 1;
+    if(ShouldReclaim()) 
+        Compact();
+    return true;
 }
 
 int WOLeaf::Scan(const _key_t &startKey, int len, Record *result) {
-    static const int MAX_RUN_NUM = GLOBAL_LEAF_SIZE / PIECE_SIZE;
-    Record * sort_runs[MAX_RUN_NUM + 1];
-    int ends[MAX_RUN_NUM + 1];
+    Record * sort_runs[MAX_RUN_NUM];
+    int starts[MAX_RUN_NUM], ends[MAX_RUN_NUM];
 
-    int16_t total_count = inital_count + insert_count;
-    int16_t bin_end = insert_count / PIECE_SIZE * PIECE_SIZE;
-    if(bin_end < insert_count) {
-        std::sort(recs + inital_count + bin_end, recs + total_count);
+    int run_cnt = CollectRuns(sort_runs, ends);
+    for(int i = 0; i < run_cnt; i++) {
+        starts[i] = BinSearch_Locate(sort_runs[i], ends[i], startKey);
     }
 
-    int run_cnt = 0;
-    if(inital_count > 0) {
-        sort_runs[0] = recs;
-        ends[0] = inital_count;
-        run_cnt += 1;
-    }
-    for(int i = inital_count; i < total_count; i += PIECE_SIZE) {
-        sort_runs[run_cnt] = recs + i;
-        ends[run_cnt] = (i + PIECE_SIZE <= total_count) ? PIECE_SIZE : total_count - i;
-        run_cnt += 1;
+    // the newest version of each key, unless it was removed
+    LoserTree tree(sort_runs, starts, ends, run_cnt);
+    int cur = 0;
+    while(cur < len && !tree.Empty()) {
+        Record r = tree.PopNewest();
+        if(r.val != Removed()) 
+            result[cur++] = r;
     }
-
-    int cur = KWayScan(sort_runs, ends, run_cnt, startKey, len, result);
     
     if(cur >= len) 
         return len;
     else if(sibling == nullptr) 
         return cur;
     else
-        return cur + ((BaseNode *) sibling)->Scan(result[cur - 1].key, len - cur, result + cur);
+        return cur + ((BaseNode *) sibling)->Scan(cur > 0 ? result[cur - 1].key : startKey, len - cur, result + cur);
 }
 
 void WOLeaf::Dump(std::vector<Record> & out) {
-    static const int MAX_RUN_NUM = GLOBAL_LEAF_SIZE / PIECE_SIZE;
-    Record * sort_runs[MAX_RUN_NUM + 1];
-    int lens[MAX_RUN_NUM + 1];
+    Record * sort_runs[MAX_RUN_NUM];
+    int lens[MAX_RUN_NUM];
+
+    int run_cnt = CollectRuns(sort_runs, lens);
+
+    // keep the newest version of each key, and drop it if it was removed
+    int from = out.size();
+    KWayMerge_nodup(sort_runs, lens, run_cnt, out);
+    out.erase(std::remove_if(out.begin() + from, out.end(), 
+                [](const Record & r) { return r.val == Removed(); }), out.end());
+}
 
+int WOLeaf::CollectRuns(Record ** runs, int * lens) {
     int16_t total_count = inital_count + insert_count;
     int16_t bin_end = insert_count / PIECE_SIZE * PIECE_SIZE;
     if(bin_end < insert_count) {
-        std::sort(recs + inital_count + bin_end, recs + total_count);
+        SortRecords(recs + inital_count + bin_end, total_count - inital_count - bin_end);
+        RebuildTail();
     }
 
     int run_cnt = 0;
     if(inital_count > 0) {
-        sort_runs[0] = recs;
+        runs[0] = recs;
         lens[0] = inital_count;
         run_cnt += 1;
     }
     for(int i = inital_count; i < total_count; i += PIECE_SIZE) {
-        sort_runs[run_cnt] = recs + i;
+        runs[run_cnt] = recs + i;
         lens[run_cnt] = (i + PIECE_SIZE <= total_count) ? PIECE_SIZE : total_count - i;
         run_cnt += 1;
     }
 
-    KWayMerge(sort_runs, lens, run_cnt, out);
-    return ;
+    return run_cnt;
 }
 
-void WOLeaf::DoSplit(_key_t * split_key, WOLeaf ** split_node) {
-    std::vector<Record> data;
-    data.reserve(inital_count + insert_count);
-    Dump(data);
+int WOLeaf::ProbeTail(_key_t k) {
+    if(insert_count % PIECE_SIZE == 0) // the tail is empty
+        return -1;
+
+    Record * tail = recs + inital_count + insert_count / PIECE_SIZE * PIECE_SIZE;
+    TailSlot * table = TailTable();
+    uint64_t h = PieceFilter::Hash(k);
+    uint16_t fp = h >> 48;
+    for(int s = h % TAIL_SLOTS; table[s].pos != 0; s = (s + 1) % TAIL_SLOTS) {
+        if(table[s].fp == fp && tail[table[s].pos - 1].key == k) 
+            return table[s].pos - 1;
+    }
+    return -1;
+}
+
+void WOLeaf::IndexTail(_key_t k, int pos) {
+    TailSlot * table = TailTable();
+    uint64_t h = PieceFilter::Hash(k);
+    int s = h % TAIL_SLOTS;
+    while(table[s].pos != 0) {
+        s = (s + 1) % TAIL_SLOTS;
+    }
+    table[s] = {(uint16_t)(h >> 48), (uint16_t)(pos + 1)};
+}
+
+void WOLeaf::RebuildTail() {
+    int bin_end = insert_count / PIECE_SIZE * PIECE_SIZE;
+    Record * tail = recs + inital_count + bin_end;
+    memset(TailTable(), 0, sizeof(TailSlot) * TAIL_SLOTS);
+    for(int i = 0; i < insert_count - bin_end; i++) {
+        IndexTail(tail[i].key, i);
+    }
+}
+
+void WOLeaf::Compact() {
+    std::vector<Record> merged;
+    merged.reserve(inital_count + insert_count);
+    Dump(merged);
+    Compact(merged);
+}
+
+void WOLeaf::Compact(std::vector<Record> & merged) {
+    // the merged run never holds more records than the runs it replaces
+    int before = inital_count + insert_count;
+    memcpy(recs, merged.data(), sizeof(Record) * merged.size());
+    reclaimed_bytes += sizeof(Record) * (before - merged.size());
+
+    inital_count = merged.size();
+    insert_count = 0;
+    remove_count = 0;
+    InitialModel()->Train(recs, inital_count);
+}
 
-    int pid = getSubOptimalSplitkey(data.data(), inital_count + insert_count);
+void WOLeaf::DoSplit(std::vector<Record> & data, _key_t * split_key, WOLeaf ** split_node) {
     // creat two new nodes
-    WOLeaf * left = new WOLeaf(data.data(), pid);
-    WOLeaf * right = new WOLeaf(data.data() + pid, data.size() - pid);
+    BaseNode * left, * right;
+    SplitLeaf(this, data, split_key, &left, &right);
     left->sibling = right;
     right->sibling = sibling;
 
     // update splitting info
-    *split_key = data[pid].key;
-    *split_node = right;
+    *split_node = (WOLeaf *) right;
 
     SwapNode(this, left);
-    delete left;
+    delete (WOLeaf *) left;
 }
 
 void WOLeaf::Print(string prefix) {
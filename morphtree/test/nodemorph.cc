@@ -1,4 +1,5 @@
 #include <random>
+#include <cmath>
 
 #include "../src/node.h"
 #include "gtest/gtest.h"
@@ -37,6 +38,27 @@ TEST(NodeMorph, wonode) {
     delete n;
 }
 
+TEST(NodeMorph, wonode_empty) {
+    // an emptied WOLeaf morphs into a leaf with the model of an empty one
+    for(NodeType to : {NodeType::ROLEAF, NodeType::RWLEAF}) {
+        BaseNode * n = new WOLeaf;
+        MorphNode(n, NodeType::WOLEAF, to);
+        ASSERT_EQ(n->node_type, to);
+        ASSERT_TRUE(std::isfinite(reinterpret_cast<ROLeaf *>(n)->slope));
+        ASSERT_TRUE(std::isfinite(reinterpret_cast<ROLeaf *>(n)->intercept));
+
+        for(uint64_t i = 0; i < SCALE1; i++) {
+            ASSERT_FALSE(n->Store(i, _val_t(i), nullptr, nullptr));
+        }
+        _val_t res;
+        for(uint64_t i = 0; i < SCALE1; i++) {
+            ASSERT_TRUE(n->Lookup(i, res));
+            ASSERT_EQ(res, _val_t(i));
+        }
+        n->DeleteNode();
+    }
+}
+
 TEST(NodeMorph, ronode) {
     int load_size = SCALE1 * 3 / 5;
 
@@ -72,6 +94,127 @@ TEST(NodeMorph, ronode) {
     delete n;
 }
 
+TEST(NodeMorph, rwnode) {
+    int load_size = SCALE1 * 3 / 5;
+
+    _key_t split_key = UINT64_MAX;
+    BaseNode * split_node = nullptr;
+    Record * tmp = new Record[SCALE1];
+    for(uint64_t i = 0; i < SCALE1; i++) {
+        tmp[i].key = i;
+        tmp[i].val = (_val_t)i;
+    }
+    std::shuffle(tmp, tmp + SCALE1 - 1, std::default_random_engine(getRandom()));
+
+    // bulk load
+    std::sort(tmp, tmp + load_size);
+    BaseNode * n = new RWLeaf(tmp, load_size);
+
+    // test insert, some of the records stay in the insert buffer
+    for(uint64_t i = load_size; i < SCALE1; i++) {
+        ASSERT_FALSE(n->Store(tmp[i].key, tmp[i].val, &split_key, &split_node));
+    }
+
+    // morph through all the leaf types
+    MorphNode(n, NodeType::RWLEAF, NodeType::WOLEAF);
+    MorphNode(n, NodeType::WOLEAF, NodeType::RWLEAF);
+    MorphNode(n, NodeType::RWLEAF, NodeType::ROLEAF);
+    MorphNode(n, NodeType::ROLEAF, NodeType::RWLEAF);
+
+    // test lookup
+    _val_t res;
+    for(uint64_t i = 0; i < SCALE1; i++) {
+        ASSERT_TRUE(n->Lookup(i, res));
+        ASSERT_EQ(res, _val_t(i));
+    }
+    ASSERT_EQ(split_node, nullptr);
+
+    delete tmp;
+    n->DeleteNode();
+}
+
+TEST(NodeMorph, rwnode_full) {
+    _key_t split_key = MAX_KEY;
+    BaseNode * split_node = nullptr;
+    std::vector<_key_t> keys(GLOBAL_LEAF_SIZE + RWLeaf::BUFFER_SIZE);
+    for(uint64_t i = 0; i < keys.size(); i++) {
+        keys[i] = i;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::default_random_engine(997));
+
+    // scans drain the insert buffer in between, the leaf still splits before it fills up
+    BaseNode * n = new RWLeaf;
+    bool splitIf = false;
+    Record r;
+    for(uint64_t i = 0; i < keys.size() && !splitIf; i++) {
+        splitIf = n->Store(keys[i], _val_t((uint64_t)keys[i]), &split_key, &split_node);
+        n->Scan(keys[i], 1, &r);
+        ASSERT_LT(reinterpret_cast<RWLeaf *>(n)->Count(), GLOBAL_LEAF_SIZE);
+    }
+    ASSERT_TRUE(splitIf);
+    MorphNode(n, NodeType::RWLEAF, NodeType::WOLEAF);
+    ASSERT_EQ(n->node_type, NodeType::WOLEAF);
+    n->DeleteNode();
+    split_node->DeleteNode();
+
+    // a leaf filled without splitting is not morphed into a WOLeaf
+    n = new RWLeaf;
+    for(uint64_t i = 0; i < keys.size(); i++) {
+        n->Store(keys[i], _val_t((uint64_t)keys[i]), nullptr, nullptr);
+    }
+    n->Scan(0, 1, &r);
+    MorphNode(n, NodeType::RWLEAF, NodeType::WOLEAF);
+    ASSERT_EQ(n->node_type, NodeType::RWLEAF);
+
+    _val_t res;
+    for(uint64_t i = 0; i < keys.size(); i++) {
+        ASSERT_TRUE(n->Lookup(keys[i], res));
+        ASSERT_EQ(res, _val_t((uint64_t)keys[i]));
+    }
+    n->DeleteNode();
+}
+
+TEST(NodeMorph, split) {
+    const int SCALE2 = GLOBAL_LEAF_SIZE; // big enough to trigger a node split
+    int load_size = SCALE2 / 2;
+
+    _key_t split_key = MAX_KEY;
+    BaseNode * split_node = nullptr;
+    Record * tmp = new Record[SCALE2];
+    for(uint64_t i = 0; i < SCALE2; i++) {
+        tmp[i].key = i;
+        tmp[i].val = (_val_t)i;
+    }
+    BaseNode * n = new WOLeaf(tmp, load_size);
+
+    // append to the tail of the key range, so that only the right half is written
+    do_morphing = true;
+    bool splitIf = false;
+    for(uint64_t i = load_size; i < SCALE2 && !splitIf; i++) {
+        splitIf = n->Store(tmp[i].key, tmp[i].val, &split_key, &split_node);
+    }
+    do_morphing = false;
+    ASSERT_TRUE(splitIf);
+
+    // the cold half becomes read optimized, the hot half stays write optimized
+    ASSERT_EQ(n->node_type, NodeType::ROLEAF);
+    ASSERT_EQ(split_node->node_type, NodeType::WOLEAF);
+    ASSERT_EQ(n->sibling, split_node);
+
+    _val_t res;
+    for(uint64_t i = 0; i < SCALE2; i++) {
+        if(tmp[i].key < split_key)
+            ASSERT_TRUE(n->Lookup(tmp[i].key, res));
+        else
+            ASSERT_TRUE(split_node->Lookup(tmp[i].key, res));
+        ASSERT_EQ(res, tmp[i].val);
+    }
+
+    delete tmp;
+    n->DeleteNode();
+    split_node->DeleteNode();
+}
+
 int main(int argc, char ** argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
@@ -1,5 +1,6 @@
 #include <random>
 #include <algorithm>
+#include <cmath>
 #include <random>
 
 #include "../src/node.h"
@@ -41,6 +42,204 @@ TEST(SingleNode, woleaf) {
     delete n;
 }
 
+TEST(SingleNode, woleaf_absent) {
+    WOLeaf * n = new WOLeaf;
+
+    // even keys span several sorted pieces and an unsorted tail
+    std::vector<_key_t> keys;
+    for(int i = 0; i < SCALE1; i++) {
+        keys.push_back(i * 2);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::default_random_engine(997));
+    for(_key_t k : keys) {
+        n->Store(k, (_val_t)(uint64_t)(k + 1), nullptr, nullptr);
+        if(CONFIG_COMPACT_PIECES > 0) { // sorted pieces are merged into the initial run before they pile up
+            ASSERT_LE(n->RunCount(), CONFIG_COMPACT_PIECES + 1);
+        }
+    }
+
+    _val_t res;
+    for(int i = 0; i < SCALE1 * 2; i++) {
+        if(i % 2 == 0) {
+            ASSERT_TRUE(n->Lookup(i, res));
+            ASSERT_EQ(res, (_val_t)(uint64_t)(i + 1));
+        } else {
+            ASSERT_FALSE(n->Lookup(i, res));
+            ASSERT_FALSE(n->Update(i, res));
+            ASSERT_FALSE(n->Remove(i));
+        }
+    }
+    ASSERT_FALSE(n->Lookup(-2, res));
+    ASSERT_FALSE(n->Lookup(SCALE1 * 2, res));
+    ASSERT_TRUE(n->Lookup(-0.0, res)); // the same key as 0
+
+    delete n;
+}
+
+TEST(SingleNode, woleaf_initial) {
+    // skewed keys in the initial run, and uniform keys in the pieces behind it
+    std::vector<Record> tmp(SCALE1);
+    for(int i = 0; i < SCALE1; i++) {
+        tmp[i] = Record(std::pow(1.001, i), (_val_t)(uint64_t)(i + 1));
+    }
+    WOLeaf * n = new WOLeaf(tmp.data(), SCALE1 / 2);
+    for(int i = SCALE1 / 2; i < SCALE1; i++) {
+        tmp[i].key = SCALE1 + i;
+        n->Store(tmp[i].key, tmp[i].val, nullptr, nullptr);
+    }
+
+    _val_t res;
+    for(int i = 0; i < SCALE1; i++) {
+        ASSERT_TRUE(n->Update(tmp[i].key, (_val_t)(uint64_t)(i + 2)));
+        ASSERT_TRUE(n->Lookup(tmp[i].key, res));
+        ASSERT_EQ(res, (_val_t)(uint64_t)(i + 2));
+    }
+    for(int i = 0; i < SCALE1; i += 2) {
+        ASSERT_TRUE(n->Remove(tmp[i].key));
+    }
+    ASSERT_EQ(n->Count(), SCALE1 / 2);
+
+    delete n;
+}
+
+TEST(SingleNode, woleaf_tail) {
+    WOLeaf * n = new WOLeaf;
+    int num = CONFIG_PIECE + CONFIG_PIECE / 2; // one sorted piece and an unsorted tail
+
+    std::vector<_key_t> keys;
+    for(int i = 0; i < num; i++) {
+        keys.push_back(i * 2);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::default_random_engine(997));
+    for(_key_t k : keys) {
+        n->Store(k, (_val_t)(uint64_t)(k + 1), nullptr, nullptr);
+    }
+
+    _val_t res;
+    for(int round = 0; round < 2; round++) {
+        for(int i = 0; i < num * 2; i++) {
+            ASSERT_EQ(n->Lookup(i, res), i % 2 == 0);
+            if(i % 2 == 0) ASSERT_EQ(res, (_val_t)(uint64_t)(i + 1));
+        }
+
+        // a scan sorts the tail in place, which must not lose track of its records
+        Record out[8];
+        ASSERT_EQ(n->Scan(0, 8, out), 8);
+    }
+
+    for(int i = 0; i < num; i++) {
+        _key_t k = keys[i];
+        ASSERT_TRUE(n->Update(k, (_val_t)(uint64_t)(k + 2)));
+        ASSERT_TRUE(n->Lookup(k, res));
+        ASSERT_EQ(res, (_val_t)(uint64_t)(k + 2));
+        ASSERT_FALSE(n->Update(k + 1, res));
+    }
+
+    delete n;
+}
+
+TEST(SingleNode, woleaf_upsert) {
+    WOLeaf * n = new WOLeaf;
+    const int KEYS = 2000; // spread over the initial run, the pieces and the tail
+
+    // store every key several times, the newest version wins
+    _key_t split_k;
+    WOLeaf * split_node;
+    for(int round = 1; round <= 8; round++) {
+        for(int i = 0; i < KEYS; i++) {
+            _key_t k = (i * 7919) % KEYS;
+            ASSERT_FALSE(n->Store(k, (_val_t)(uint64_t)(k * 10 + round), &split_k, &split_node));
+        }
+    }
+
+    _val_t res;
+    for(int i = 0; i < KEYS; i++) {
+        ASSERT_TRUE(n->Lookup(i, res));
+        ASSERT_EQ(res, (_val_t)(uint64_t)(i * 10 + 8));
+    }
+
+    // a removed key hides its older versions until it is stored again
+    for(int i = 0; i < KEYS; i += 2) {
+        ASSERT_TRUE(n->Remove(i));
+        ASSERT_FALSE(n->Remove(i));
+        ASSERT_FALSE(n->Lookup(i, res));
+        ASSERT_FALSE(n->Update(i, res));
+    }
+    for(int i = 0; i < KEYS; i += 4) {
+        n->Store(i, (_val_t)(uint64_t)(i * 10 + 9), &split_k, &split_node);
+    }
+
+    std::vector<Record> out;
+    n->Dump(out);
+    ASSERT_EQ(out.size(), KEYS / 2 + KEYS / 4);
+    for(auto & r : out) {
+        int i = r.key;
+        ASSERT_TRUE(i % 4 == 0 || i % 2 == 1);
+        ASSERT_EQ(r.val, (_val_t)(uint64_t)(i * 10 + (i % 4 == 0 ? 9 : 8)));
+        ASSERT_TRUE(n->Lookup(i, res));
+        ASSERT_EQ(res, r.val);
+    }
+
+    // scans see one version of each key
+    Record scan[64];
+    ASSERT_EQ(n->Scan(1, 64, scan), 64);
+    for(int i = 1; i < 64; i++) {
+        ASSERT_LT(scan[i - 1].key, scan[i].key);
+    }
+
+    delete n;
+}
+
+TEST(SingleNode, woleaf_reclaim) {
+    WOLeaf * n = new WOLeaf;
+    _key_t split_k;
+    WOLeaf * split_node = nullptr;
+    reclaimed_bytes = 0;
+
+    const int KEYS = 6000;
+    for(int i = 0; i < KEYS; i++) {
+        n->Store(i, (_val_t)(uint64_t)(i + 1), &split_k, &split_node);
+    }
+
+    // removed records are dropped once they make up a quarter of the leaf
+    for(int i = 0; i < KEYS; i += 3) {
+        ASSERT_TRUE(n->Remove(i));
+        ASSERT_LT(n->Tombstones(), KEYS / 4 + 1);
+    }
+    ASSERT_GT(reclaimed_bytes, 0);
+    ASSERT_EQ(n->Count(), KEYS - KEYS / 3);
+
+    Record out[16];
+    ASSERT_EQ(n->Scan(0, 16, out), 16);
+    for(int j = 0; j < 16; j++) {
+        ASSERT_EQ(out[j].key, j / 2 * 3 + 1 + j % 2);
+    }
+
+    _val_t res;
+    for(int i = 0; i < KEYS; i++) {
+        ASSERT_EQ(n->Lookup(i, res), i % 3 != 0);
+    }
+    delete n;
+
+    // a leaf filled up by older versions makes room for itself instead of splitting
+    const int LIVE = GLOBAL_LEAF_SIZE * 2 / 3;
+    n = new WOLeaf;
+    for(int round = 0; round < 3; round++) {
+        uint64_t before = reclaimed_bytes;
+        for(int i = 0; i < LIVE; i++) {
+            ASSERT_FALSE(n->Store(i, (_val_t)(uint64_t)(i + round), &split_k, &split_node));
+        }
+        if(round > 0) ASSERT_GT(reclaimed_bytes, before);
+    }
+    ASSERT_EQ(split_node, nullptr);
+
+    for(int i = 0; i < LIVE; i++) {
+        ASSERT_TRUE(n->Lookup(i, res));
+        ASSERT_EQ(res, (_val_t)(uint64_t)(i + 2));
+    }
+    delete n;
+}
+
 TEST(SingleNode, roleaf) {
     int load_size = SCALE1 * 3 / 5;
 
@@ -75,14 +274,171 @@ TEST(SingleNode, roleaf) {
     delete n;
 }   
 
+TEST(SingleNode, roleaf_bulk_layout) {
+    const int num = GLOBAL_LEAF_SIZE * 3 / 4;
+    std::default_random_engine gen(997);
+    std::uniform_real_distribution<double> uniform(0, 1e9);
+    std::normal_distribution<double> cluster(0, 1e3);
+    std::lognormal_distribution<double> skew(0, 2);
+
+    for(int kind = 0; kind < 3; kind++) {
+        // distinct keys: uniform, a few tight clusters, and skewed
+        std::vector<_key_t> keys;
+        while(keys.size() < num) {
+            for(int i = keys.size(); i < num; i++) {
+                double k = kind == 0 ? uniform(gen) : (kind == 1 ? gen() % 8 * 1e8 + cluster(gen) : skew(gen) * 1e6);
+                keys.push_back(std::floor(k));
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        }
+        std::vector<Record> recs(num);
+        for(int i = 0; i < num; i++) {
+            recs[i] = Record(keys[i], (_val_t)(uint64_t)(i + 1));
+        }
+
+        // a leaf built in one pass is laid out as one with the same model filled by Store
+        ROLeaf * bulk = new ROLeaf(recs.data(), num);
+        ROLeaf * stored = new ROLeaf();
+        stored->slope = bulk->slope;
+        stored->intercept = bulk->intercept;
+        for(auto & r : recs) {
+            ASSERT_FALSE(stored->Store(r.key, r.val, nullptr, nullptr));
+        }
+        ASSERT_GT(bulk->of_count, 0);
+        ASSERT_EQ(bulk->count, stored->count);
+        ASSERT_EQ(bulk->of_count, stored->of_count);
+
+        for(int b = 0; b < ROLeaf::NODE_SIZE; b += ROLeaf::PROBE_SIZE) {
+            for(int j = 0; j < ROLeaf::PROBE_SIZE - 1; j++) {
+                ASSERT_EQ(bulk->recs[b + j].key, stored->recs[b + j].key);
+                ASSERT_EQ(bulk->recs[b + j].val, stored->recs[b + j].val);
+            }
+
+            Record * bulk_of, * stored_of;
+            int of_len = bulk->Overflow(b, &bulk_of);
+            ASSERT_EQ(of_len, stored->Overflow(b, &stored_of));
+            for(int j = 0; j < of_len; j++) {
+                ASSERT_EQ(bulk_of[j].key, stored_of[j].key);
+                ASSERT_EQ(bulk_of[j].val, stored_of[j].val);
+            }
+        }
+
+        delete bulk;
+        delete stored;
+    }
+}
+
+TEST(SingleNode, roleaf_overflow_upsert) {
+    const int num = GLOBAL_LEAF_SIZE / 2;
+    std::default_random_engine gen(997);
+    std::uniform_real_distribution<double> uniform(0, 1e9);
+
+    std::vector<_key_t> keys;
+    while(keys.size() < num) {
+        for(int i = keys.size(); i < num; i++) {
+            keys.push_back(std::floor(uniform(gen)));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+    std::vector<Record> recs(num);
+    for(int i = 0; i < num; i++) {
+        recs[i] = Record(keys[i], (_val_t)(uint64_t)(i + 1));
+    }
+
+    ROLeaf * ro = new ROLeaf(recs.data(), num);
+    RWLeaf * rw = new RWLeaf(recs.data(), num);
+    std::vector<_key_t> of_keys;
+    for(int b = 0; b < ROLeaf::NODE_SIZE; b += ROLeaf::PROBE_SIZE) {
+        Record * of_recs;
+        int of_len = ro->Overflow(b, &of_recs);
+        for(int j = 0; j < of_len && of_recs[j].key != MAX_KEY; j++) {
+            of_keys.push_back(of_recs[j].key);
+        }
+    }
+    ASSERT_GT(of_keys.size(), 0);
+    int of_count = ro->of_count;
+    ASSERT_LE(of_count, GLOBAL_LEAF_SIZE / 4);
+
+    // upsert the overflowed keys more often than the overflow split threshold, neither leaf grows nor splits
+    _key_t split_key;
+    ROLeaf * ro_split = nullptr;
+    RWLeaf * rw_split = nullptr;
+    int rounds = GLOBAL_LEAF_SIZE / of_keys.size() + 1;
+    for(int r = 0; r < rounds; r++) {
+        for(auto k : of_keys) {
+            ASSERT_FALSE(ro->Store(k, (_val_t)(uint64_t)r, &split_key, &ro_split));
+            ASSERT_FALSE(rw->Store(k, (_val_t)(uint64_t)r, &split_key, &rw_split));
+        }
+    }
+    ASSERT_EQ(ro_split, nullptr);
+    ASSERT_EQ(rw_split, nullptr);
+    ASSERT_EQ(ro->Count(), num);
+    ASSERT_EQ(ro->of_count, of_count);
+
+    std::vector<Record> out;
+    rw->Dump(out); // drains the insert buffer
+    ASSERT_EQ(out.size(), num);
+    ASSERT_EQ(rw->Count(), num);
+
+    _val_t res;
+    for(auto k : of_keys) {
+        ASSERT_TRUE(ro->Lookup(k, res));
+        ASSERT_EQ(res, (_val_t)(uint64_t)(rounds - 1));
+        ASSERT_TRUE(rw->Lookup(k, res));
+        ASSERT_EQ(res, (_val_t)(uint64_t)(rounds - 1));
+    }
+
+    delete ro;
+    delete rw;
+}
+
+TEST(SingleNode, rwleaf) {
+    int load_size = SCALE1 * 3 / 5;
+
+    _key_t split_key = MAX_KEY;
+    RWLeaf * split_node = nullptr;
+    Record * tmp = new Record[SCALE1];
+    for(uint64_t i = 0; i < SCALE1; i++) {
+        tmp[i].key = i;
+        tmp[i].val = (_val_t)i;
+    }
+    std::shuffle(tmp, tmp + SCALE1 - 1, std::default_random_engine(997));
+
+    // bulk load
+    std::sort(tmp, tmp + load_size);
+    RWLeaf * n = new RWLeaf(tmp, load_size);
+
+    // test insert, some of the records stay in the insert buffer
+    for(uint64_t i = load_size; i < SCALE1; i++) {
+        ASSERT_FALSE(n->Store((_key_t)tmp[i].key, tmp[i].val, &split_key, &split_node));
+    }
+
+    // test lookup
+    _val_t res;
+    for(uint64_t i = 0; i < SCALE1; i++) {
+        ASSERT_TRUE(n->Lookup(tmp[i].key, res));
+        ASSERT_EQ((uint64_t)res, uint64_t(tmp[i].key));
+    }
+
+    // test upsert and remove of buffered records
+    n->Store(tmp[SCALE1 - 1].key, _val_t(1), nullptr, nullptr);
+    ASSERT_TRUE(n->Lookup(tmp[SCALE1 - 1].key, res));
+    ASSERT_EQ(res, _val_t(1));
+    ASSERT_TRUE(n->Remove(tmp[SCALE1 - 1].key));
+    ASSERT_FALSE(n->Lookup(tmp[SCALE1 - 1].key, res));
+
+    delete tmp;
+    delete n;
+}
+
 TEST(SingleNode, roinner) {
     int load_size = SCALE1;
     //std::default_random_engine gen(getRandom());
     std::default_random_engine gen(997);
     std::uniform_int_distribution<uint64_t> dist(0, SCALE1 * 10);
 
-    _key_t split_key = MAX_KEY;
-    ROInner * split_node = nullptr;
     Record * tmp = new Record[SCALE1];
     for(uint64_t i = 0; i < SCALE1; i++) {
         tmp[i].key = dist(gen);
@@ -108,6 +464,328 @@ TEST(SingleNode, roinner) {
     delete tmp;
 }
 
+TEST(SingleNode, roinner_skew) {
+    int load_size = SCALE1;
+    std::default_random_engine gen(997);
+    std::lognormal_distribution<double> dist(0, 2);
+
+    Record * tmp = new Record[SCALE1];
+    for(uint64_t i = 0; i < SCALE1; i++) {
+        tmp[i].key = dist(gen) * 1e9;
+        tmp[i].val = _val_t(i + 1);
+    }
+    std::sort(tmp, tmp + load_size);
+    
+    // skewed keys are segmented, and few of them spill into overflow nodes
+    ROInner * n = new ROInner(tmp, load_size);
+    ASSERT_GT(n->seg_num, 1);
+    ASSERT_LT(n->of_count, load_size / 16);
+
+    _val_t res;
+    for(uint64_t i = 0; i < SCALE1; i++) {
+        ASSERT_TRUE(n->Lookup(tmp[i].key, res));
+        if(res != tmp[i].val) {
+            ROInner * inner = (ROInner *) res;
+            ASSERT_TRUE(inner->Lookup(tmp[i].key, res));
+            ASSERT_EQ(res, tmp[i].val);
+        }
+    }
+
+    delete [] tmp;
+}
+
+TEST(SingleNode, model_build) {
+    std::default_random_engine gen(997);
+    std::uniform_int_distribution<int> dist(0, SCALE1 * 100);
+
+    for(double offset : {0.0, 1e9, 1e15}) {
+        std::vector<Record> tmp(SCALE1);
+        for(auto & r : tmp) {
+            r = Record(offset + dist(gen), nullptr);
+        }
+        std::sort(tmp.begin(), tmp.end());
+
+        LinearModelBuilder model;
+        model.build(tmp.data(), SCALE1 / 8, SCALE1 * 7 / 8);
+        ASSERT_GT(model.a_, 0);
+
+        // uniform keys: every record is predicted close to its position
+        for(int i = SCALE1 / 8; i < SCALE1 * 7 / 8; i++) {
+            ASSERT_NEAR(model.predict(tmp[i].key), i, SCALE1 / 16);
+        }
+        
+        if(offset == 0) { // where precision is no concern, it matches the incremental builder
+            LinearModelBuilder ref;
+            for(int i = SCALE1 / 8; i < SCALE1 * 7 / 8; i++) {
+                ref.add(tmp[i].key, i);
+            }
+            ref.build();
+            ASSERT_NEAR(model.a_, ref.a_, 1e-9 * ref.a_);
+            ASSERT_NEAR(model.b_, ref.b_, 1e-6);
+        }
+
+        // the same points in any order fit the same line
+        std::vector<int> order;
+        for(int i = SCALE1 / 8; i < SCALE1 * 7 / 8; i++) {
+            order.push_back(i);
+        }
+        std::shuffle(order.begin(), order.end(), gen);
+        std::vector<_key_t> xs;
+        std::vector<int> ys;
+        for(int i : order) {
+            xs.push_back(tmp[i].key);
+            ys.push_back(i);
+        }
+        LinearModelBuilder points;
+        points.build(xs.data(), ys.data(), xs.size());
+        ASSERT_NEAR(points.a_, model.a_, 1e-9 * model.a_);
+        for(int i = SCALE1 / 8; i < SCALE1 * 7 / 8; i += 97) {
+            ASSERT_NEAR(points.predict(tmp[i].key), model.predict(tmp[i].key), 1);
+        }
+    }
+}
+
+TEST(SingleNode, sort_records) {
+    std::default_random_engine gen(997);
+    std::normal_distribution<double> normal(0, 3);
+    std::uniform_int_distribution<int> dup(0, 50);
+
+    for(int n : {10, 100, 1024, 5000}) {
+        for(int kind = 0; kind < 3; kind++) {
+            // skewed keys of both signs, and keys with many duplicates
+            std::vector<Record> recs(n);
+            for(int i = 0; i < n; i++) {
+                double k = kind == 0 ? normal(gen) : (kind == 1 ? std::exp(normal(gen)) : dup(gen) * 1e6);
+                recs[i] = Record(k, (_val_t)(uint64_t)i);
+            }
+
+            std::vector<Record> expect = recs;
+            std::stable_sort(expect.begin(), expect.end(), 
+                        [](const Record & a, const Record & b) { return a.key < b.key; });
+            SortRecords(recs.data(), n);
+            for(int i = 0; i < n; i++) {
+                ASSERT_EQ(recs[i].key, expect[i].key);
+                ASSERT_EQ(recs[i].val, expect[i].val);
+            }
+        }
+    }
+}
+
+TEST(SingleNode, kway_merge) {
+    std::default_random_engine gen(997);
+    std::uniform_int_distribution<int> dist(0, SCALE1);
+
+    for(int k : {1, 2, 3, 5, 11}) {
+        // run i holds the value i, so that the order of equal keys can be told
+        std::vector<std::vector<Record>> runs(k);
+        Record * run_ptrs[16];
+        int lens[16];
+        std::vector<Record> expect;
+        for(int i = 0; i < k; i++) {
+            runs[i].resize(i == 1 ? 0 : dist(gen) % 1000 + 1);
+            for(auto & r : runs[i]) {
+                r = Record(dist(gen), (_val_t)(uint64_t)i);
+            }
+            std::sort(runs[i].begin(), runs[i].end());
+            run_ptrs[i] = runs[i].data();
+            lens[i] = runs[i].size();
+            expect.insert(expect.end(), runs[i].begin(), runs[i].end());
+        }
+        std::stable_sort(expect.begin(), expect.end(), 
+                        [](const Record & a, const Record & b) { return a.key < b.key; });
+
+        std::vector<Record> out;
+        KWayMerge(run_ptrs, lens, k, out);
+        ASSERT_EQ(out.size(), expect.size());
+        for(int i = 0; i < (int)out.size(); i++) {
+            ASSERT_EQ(out[i].key, expect[i].key);
+            ASSERT_EQ(out[i].val, expect[i].val);
+        }
+
+        Record scan[100];
+        _key_t start = SCALE1 / 2;
+        int first = std::lower_bound(expect.begin(), expect.end(), start, 
+                        [](const Record & r, _key_t k) { return r.key < k; }) - expect.begin();
+        int len = KWayScan(run_ptrs, lens, k, start, 100, scan);
+        ASSERT_EQ(len, std::min(100, (int)expect.size() - first));
+        for(int i = 0; i < len; i++) {
+            ASSERT_EQ(scan[i].key, expect[first + i].key);
+            ASSERT_EQ(scan[i].val, expect[first + i].val);
+        }
+
+        // the version from the newest run wins, which is the last one after a stable sort
+        std::vector<Record> newest;
+        for(int i = 0; i < (int)expect.size(); i++) {
+            if(i + 1 == (int)expect.size() || expect[i + 1].key != expect[i].key) 
+                newest.push_back(expect[i]);
+        }
+        std::vector<Record> nodup;
+        KWayMerge_nodup(run_ptrs, lens, k, nodup);
+        ASSERT_EQ(nodup.size(), newest.size());
+        for(int i = 0; i < (int)nodup.size(); i++) {
+            ASSERT_EQ(nodup[i].key, newest[i].key);
+            ASSERT_EQ(nodup[i].val, newest[i].val);
+        }
+    }
+}
+
+TEST(SingleNode, lockstep_search) {
+    std::default_random_engine gen(997);
+    std::uniform_int_distribution<int> dist(0, SCALE1);
+
+    for(int k : {1, 2, 3, 5, 11}) {
+        // run i holds the value i, a key in several runs is found in the first of them
+        std::vector<std::vector<Record>> runs(k);
+        Record * run_ptrs[16];
+        int lens[16];
+        for(int i = 0; i < k; i++) {
+            runs[i].resize(i == 1 ? 1 : dist(gen) % 1000 + 1);
+            for(auto & r : runs[i]) {
+                r = Record(dist(gen) % 5000, (_val_t)(uint64_t)i);
+            }
+            std::sort(runs[i].begin(), runs[i].end());
+            run_ptrs[i] = runs[i].data();
+            lens[i] = runs[i].size();
+        }
+
+        for(_key_t key = 0; key < 5000; key++) {
+            int expect = -1;
+            for(int i = 0; i < k && expect < 0; i++) {
+                auto it = std::lower_bound(runs[i].begin(), runs[i].end(), key, 
+                        [](const Record & r, _key_t k) { return r.key < k; });
+                if(it != runs[i].end() && it->key == key) 
+                    expect = i;
+            }
+
+            Record * r = LockstepSearch(run_ptrs, lens, k, key);
+            if(expect < 0) {
+                ASSERT_EQ(r, nullptr);
+            } else {
+                ASSERT_NE(r, nullptr);
+                ASSERT_EQ(r->key, key);
+                ASSERT_EQ(r->val, (_val_t)(uint64_t)expect);
+            }
+        }
+    }
+}
+
+TEST(SingleNode, roinner_repair) {
+    int load_size = SCALE1, hot_size = SCALE1 / 16;
+
+    // Store peeks at the children of overflowed buckets, so values are leaf headers
+    std::vector<BaseNode> leaves(load_size + hot_size);
+    for(auto & leaf : leaves) {
+        leaf.node_type = ROLEAF;
+    }
+
+    Record * tmp = new Record[load_size + hot_size];
+    for(int i = 0; i < load_size; i++) {
+        tmp[i].key = i * 100;
+        tmp[i].val = &leaves[i];
+    }
+    ROInner * n = new ROInner(tmp, load_size);
+
+    // a burst of inserts into one narrow key range is repaired locally
+    uint64_t old_rebuild = rebuild_times;
+    for(int i = load_size; i < load_size + hot_size; i++) {
+        tmp[i].key = load_size * 50 + (i - load_size + 1) * 0.25;
+        tmp[i].val = &leaves[i];
+        n->Store(tmp[i].key, tmp[i].val, nullptr, nullptr);
+    }
+    ASSERT_EQ(rebuild_times, old_rebuild);
+    ASSERT_GT(n->seg_num, 1);
+
+    _val_t res;
+    for(int i = 0; i < load_size + hot_size; i++) {
+        ROInner * inner = n;
+        while(inner->Lookup(tmp[i].key, res) && !((BaseNode *)res)->Leaf()) {
+            inner = (ROInner *) res;
+        }
+        ASSERT_EQ(res, tmp[i].val);
+    }
+
+    delete [] tmp;
+}
+
+TEST(SingleNode, roinner_remove) {
+    int load_size = SCALE1, hot_size = SCALE1 / 16, num = load_size + hot_size;
+
+    std::vector<BaseNode> leaves(num);
+    for(auto & leaf : leaves) {
+        leaf.node_type = ROLEAF;
+    }
+
+    // a dense key range that leaves overflow nodes behind
+    std::vector<Record> tmp(num);
+    for(int i = 0; i < load_size; i++) {
+        tmp[i] = Record(i * 100, &leaves[i]);
+    }
+    ROInner * n = new ROInner(tmp.data(), load_size);
+    for(int i = load_size; i < num; i++) {
+        tmp[i] = Record(load_size * 50 + (i - load_size + 1) * 0.25, &leaves[i]);
+        n->Store(tmp[i].key, tmp[i].val, nullptr, nullptr);
+    }
+    std::sort(tmp.begin(), tmp.end());
+    int old_capacity = n->capacity;
+
+    // remove three of every four index records, the node shrinks on the way
+    std::vector<int> order;
+    for(int i = 0; i < num; i++) {
+        if(i % 4 != 0) order.push_back(i);
+    }
+    std::shuffle(order.begin(), order.end(), std::default_random_engine(997));
+    for(int i : order) {
+        ASSERT_TRUE(n->Remove(tmp[i].key));
+        ASSERT_FALSE(n->Remove(tmp[i].key));
+    }
+    ASSERT_EQ(n->count, (num + 3) / 4);
+    ASSERT_LT(n->capacity, old_capacity);
+
+    // a removed key is routed to the record before it
+    for(int i = 0; i < num; i++) {
+        Record * r = n->Route(tmp[i].key);
+        ASSERT_EQ(r->key, tmp[i / 4 * 4].key);
+        ASSERT_EQ(r->val, tmp[i / 4 * 4].val);
+    }
+
+    delete n;
+}
+
+TEST(SingleNode, roinner_depth) {
+    int load_size = SCALE1, hot_size = SCALE1 / 4, num = load_size + hot_size;
+
+    std::vector<BaseNode> leaves(num);
+    for(auto & leaf : leaves) {
+        leaf.node_type = ROLEAF;
+    }
+
+    // tight clusters of keys far apart, what a single linear model fits worst
+    std::vector<Record> tmp(num);
+    for(int i = 0; i < load_size; i++) {
+        tmp[i] = Record((i / 64) * 1e6 + i % 64, &leaves[i]);
+    }
+    ROInner * n = new ROInner(tmp.data(), load_size);
+    ASSERT_LE(n->Depth(), ROInner::OVERFLOW_DEPTH + 1);
+
+    // keep inserting into the same few clusters, overflow chains must not grow without bound
+    uint64_t old_rebuild = rebuild_times;
+    for(int i = load_size; i < num; i++) {
+        int j = i - load_size;
+        tmp[i] = Record((j % 4) * 1e6 + (j / 4 + 1) / 1024.0, &leaves[i]);
+        n->Store(tmp[i].key, tmp[i].val, nullptr, nullptr);
+        ASSERT_LE(n->Depth(), ROInner::OVERFLOW_DEPTH + 2);
+    }
+    ASSERT_LT(rebuild_times - old_rebuild, 4);
+
+    for(int i = 0; i < num; i++) {
+        Record * r = n->Route(tmp[i].key);
+        ASSERT_EQ(r->key, tmp[i].key);
+        ASSERT_EQ(r->val, tmp[i].val);
+    }
+
+    delete n;
+}
+
 /* TwoNode Test: store operations may trigger a node split */
 const int SCALE2 = GLOBAL_LEAF_SIZE * 5 / 4; // big enough to trigger a node split
 
@@ -192,6 +870,49 @@ TEST(TwoNode, roleaf) {
     delete split_node;
 }
 
+TEST(TwoNode, rwleaf) {
+    _key_t split_key = MAX_KEY;
+    RWLeaf * split_node = nullptr;
+    
+    Record * tmp = new Record[SCALE2];
+    std::default_random_engine gen(997);
+    std::uniform_int_distribution<int> dist(0, SCALE2 * 100);
+
+    for(uint64_t i = 0; i < SCALE2; i++) {
+        tmp[i].key = dist(gen);
+        tmp[i].val = _val_t((uint64_t)tmp[i].key);
+    }
+    std::shuffle(tmp, tmp + SCALE2 - 1, gen);
+    std::sort(tmp, tmp + SCALE2 / 2);
+
+    // bulk load
+    RWLeaf * n = new RWLeaf(tmp, SCALE2 / 2);
+
+    // insert data into nodes
+    for(int i = SCALE2 / 2; i < SCALE2; i++) {
+        if(tmp[i].key < split_key) {
+            n->Store(tmp[i].key, tmp[i].val, &split_key, &split_node);
+        } else {
+            ASSERT_FALSE(split_node->Store(tmp[i].key, tmp[i].val, nullptr, nullptr));
+        }
+    }
+    ASSERT_NE(split_node, nullptr);
+
+    // test lookup
+    _val_t res;
+    for(uint64_t i = 0; i < SCALE2; i++) {
+        if(tmp[i].key < split_key)
+            ASSERT_TRUE(n->Lookup(tmp[i].key, res));
+        else
+            ASSERT_TRUE(split_node->Lookup(tmp[i].key, res));
+        ASSERT_EQ((uint64_t)res, uint64_t(tmp[i].key));
+    }
+    
+    delete tmp;
+    delete n;
+    delete split_node;
+}
+
 int main(int argc, char ** argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
@@ -1,4 +1,5 @@
 #include <random>
+#include <map>
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
@@ -62,7 +63,7 @@ TEST_F(rotest, update) {
     }
 } 
 
-TEST_F(rotest, DISABLED_remove) {
+TEST_F(rotest, remove) {
     // remove half of the records
     for(int i = 0; i < TEST_SCALE; i += 2) {
         tree->remove(recs[i].key);
@@ -80,6 +81,41 @@ TEST_F(rotest, DISABLED_remove) {
     }
 }
 
+TEST_F(rotest, delete_range) {
+    std::vector<LeafStats> before, after;
+    tree->dump_stats(before);
+
+    // a wide range drops the leaves in between, a narrow one trims a single leaf
+    ASSERT_EQ(tree->delete_range(_key_t(1000), _key_t(TEST_SCALE / 2)), TEST_SCALE / 2 - 1000);
+    ASSERT_EQ(tree->delete_range(_key_t(TEST_SCALE / 2 + 10), _key_t(TEST_SCALE / 2 + 20)), 10);
+    ASSERT_EQ(tree->delete_range(_key_t(100), _key_t(200)), 100);
+    ASSERT_EQ(tree->delete_range(_key_t(100), _key_t(1000)), 800);
+
+    tree->dump_stats(after);
+    ASSERT_LT(after.size() * 3, before.size() * 2);
+
+    auto deleted = [](uint64_t k) {
+        return (k >= 100 && k < TEST_SCALE / 2) || (k >= TEST_SCALE / 2 + 10 && k < TEST_SCALE / 2 + 20);
+    };
+    _val_t v;
+    for(int i = 0; i < TEST_SCALE; i++) {
+        if(deleted((uint64_t)recs[i].key)) {
+            ASSERT_FALSE(tree->lookup(recs[i].key, v));
+        } else {
+            ASSERT_TRUE(tree->lookup(recs[i].key, v));
+            ASSERT_EQ(v, recs[i].val);
+        }
+    }
+
+    // scans skip over the deleted range
+    Record buf[64];
+    ASSERT_EQ(tree->scan(_key_t(90), 64, buf), 64);
+    for(uint64_t i = 0, k = 90; i < 64; i++, k++) {
+        while(deleted(k)) k++;
+        ASSERT_EQ((uint64_t)buf[i].key, k);
+    }
+}
+
 // scan test is predicated on that key/values are sequencial number for 0 to TEST_SCALE - 1
 TEST_F(rotest, scan) {
     int max_scan_len = TEST_SCALE / 2;
@@ -99,4 +135,325 @@ TEST_F(rotest, scan) {
     }
 
     delete [] buf;
-}
\ No newline at end of file
+}
+
+TEST_F(rotest, errors) {
+    // split and merge leaves, so that the inner nodes update their error incrementally
+    for(int i = 0; i < TEST_SCALE / 4; i++) {
+        tree->insert(_key_t(i) + 0.5, _val_t((uint64_t)i));
+    }
+    for(int i = TEST_SCALE / 2; i < TEST_SCALE * 3 / 4; i++) {
+        tree->remove(_key_t(i));
+    }
+    for(int i = TEST_SCALE / 2; i < TEST_SCALE * 5 / 8; i++) { // into buckets vacated just now
+        tree->insert(_key_t(i) + 0.5, _val_t((uint64_t)i));
+    }
+
+    std::vector<InnerError> errs, fresh;
+    tree->dump_errors(errs);
+    tree->dump_errors(fresh, true);
+    ASSERT_GT(errs.size(), 0);
+    ASSERT_EQ(errs.size(), fresh.size());
+
+    // the total walk is kept exact, max_err bounds the longest walk from above
+    for(int i = 0; i < errs.size(); i++) {
+        ASSERT_DOUBLE_EQ(errs[i].avg_err, fresh[i].avg_err);
+        ASSERT_GE(errs[i].max_err, fresh[i].max_err);
+        ASSERT_LE(fresh[i].avg_err, fresh[i].max_err);
+    }
+}
+
+TEST(rotree, radix_table) {
+    const int scale = 1024000;
+    std::default_random_engine gen(997);
+    std::lognormal_distribution<double> dist(0, 2);
+
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = std::floor(dist(gen) * 1e9);
+        recs[i].val = _val_t(i + 1);
+    }
+    std::sort(recs.begin(), recs.end());
+    recs.erase(std::unique(recs.begin(), recs.end(), 
+                [](const Record & a, const Record & b) { return a.key == b.key; }), recs.end());
+
+    // bulkload a quarter of the skewed keys, the rest of them split leaves and are routed by the radix table
+    std::vector<Record> loaded, inserted;
+    for(int i = 0; i < recs.size(); i++) {
+        (i % 4 == 0 ? loaded : inserted).push_back(recs[i]);
+    }
+    std::shuffle(inserted.begin(), inserted.end(), gen);
+    
+    auto tree = new MorphtreeImpl<NodeType::ROLEAF, false>(loaded);
+    for(int i = 0; i < inserted.size(); i++) {
+        tree->insert(inserted[i].key, inserted[i].val);
+    }
+
+    _val_t v;
+    for(int i = 0; i < recs.size(); i++) {
+        ASSERT_TRUE(tree->lookup(recs[i].key, v));
+        ASSERT_EQ(v, recs[i].val);
+    }
+    delete tree;
+}
+
+TEST(rotree, append) {
+    const int scale = 1024000;
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = _key_t(i);
+        recs[i].val = _val_t(i + 1);
+    }
+
+    // appended keys pile up in the last buckets of the root, and leaves split under 
+    // overflow nodes, which the flattened snapshot of the upper levels has to follow
+    std::vector<Record> loaded(recs.begin(), recs.begin() + scale / 8);
+    auto tree = new MorphtreeImpl<NodeType::ROLEAF, false>(loaded);
+    _val_t v;
+    for(int i = scale / 8; i < scale; i++) {
+        tree->insert(recs[i].key, recs[i].val);
+        if(i % 1024 == 0) {
+            ASSERT_TRUE(tree->lookup(recs[i / 2].key, v));
+            ASSERT_EQ(v, recs[i / 2].val);
+        }
+    }
+
+    for(int i = 0; i < scale; i++) {
+        ASSERT_TRUE(tree->lookup(recs[i].key, v));
+        ASSERT_EQ(v, recs[i].val);
+    }
+    delete tree;
+}
+
+TEST(rotree, hinted_bulkload) {
+    const int scale = 102400;
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = _key_t(i);
+        recs[i].val = _val_t(i);
+    }
+
+    // the lower half is read mostly, the upper half is write mostly
+    std::vector<AccessHint> hints = {{MIN_KEY, 0.9, 0.05, 0.05}, {_key_t(scale / 2), 0.1, 0.9, 0}};
+    auto tree = new MorphtreeImpl<NodeType::ROLEAF, true>(recs, hints);
+
+    std::vector<LeafStats> leaf_stats;
+    tree->dump_stats(leaf_stats);
+    ASSERT_GT(leaf_stats.size(), 2);
+    for(int i = 0; i < leaf_stats.size(); i++) {
+        if(i > 0) ASSERT_LT(leaf_stats[i - 1].start, leaf_stats[i].start);
+        NodeType expected = leaf_stats[i].start < scale / 2 ? NodeType::ROLEAF : NodeType::WOLEAF;
+        ASSERT_EQ(leaf_stats[i].node_type, expected);
+    }
+
+    _val_t v;
+    for(int i = 0; i < scale; i++) {
+        ASSERT_TRUE(tree->lookup(recs[i].key, v));
+        ASSERT_EQ(v, recs[i].val);
+    }
+    delete tree;
+
+    // a tree bulkloaded from the dumped statistics inherits the leaf types
+    tree = new MorphtreeImpl<NodeType::ROLEAF, true>(recs, leaf_stats);
+    std::vector<LeafStats> reloaded;
+    tree->dump_stats(reloaded);
+    ASSERT_EQ(reloaded.size(), leaf_stats.size());
+    for(int i = 0; i < reloaded.size(); i++) {
+        ASSERT_EQ(reloaded[i].start, leaf_stats[i].start);
+        ASSERT_EQ(reloaded[i].node_type, leaf_stats[i].node_type);
+        ASSERT_EQ(reloaded[i].stats, leaf_stats[i].stats);
+    }
+    delete tree;
+}
+
+TEST(rotree, phase_sweep) {
+    const int scale = 102400;
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = _key_t(i);
+        recs[i].val = _val_t(i);
+    }
+
+    // an ingested tree of write optimized leaves turns to serve reads on a few hot keys
+    auto tree = new MorphtreeImpl<NodeType::WOLEAF, true>(recs);
+    _val_t v;
+    for(int i = 0; i < PHASE_EPOCH * PHASE_WINDOW * 2; i++) {
+        ASSERT_TRUE(tree->lookup(recs[i % 16].key, v));
+    }
+
+    // the idle leaves are consolidated by the sweep without being touched
+    std::vector<LeafStats> leaf_stats;
+    tree->dump_stats(leaf_stats);
+    for(int i = 0; i < leaf_stats.size(); i++) {
+        ASSERT_EQ(leaf_stats[i].node_type, NodeType::ROLEAF);
+    }
+
+    for(int i = 0; i < scale; i++) {
+        ASSERT_TRUE(tree->lookup(recs[i].key, v));
+        ASSERT_EQ(v, recs[i].val);
+    }
+    delete tree;
+}
+
+TEST(rotree, merge) {
+    const int scale = 102400;
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = _key_t(i);
+        recs[i].val = _val_t(i);
+    }
+
+    auto tree = new MorphtreeImpl<NodeType::ROLEAF, false>(recs);
+    std::vector<LeafStats> before;
+    tree->dump_stats(before);
+
+    // remove all but one of every 16 records, the underflowed leaves merge with their siblings
+    std::vector<Record> shuffled(recs);
+    std::shuffle(shuffled.begin(), shuffled.end(), std::default_random_engine(997));
+    for(int i = 0; i < scale; i++) {
+        uint64_t k = (uint64_t)shuffled[i].key;
+        if(k % 16 != 0) ASSERT_TRUE(tree->remove(shuffled[i].key));
+    }
+
+    std::vector<LeafStats> after;
+    tree->dump_stats(after);
+    ASSERT_LE(after.size() * 4, before.size());
+
+    _val_t v;
+    for(int i = 0; i < scale; i++) {
+        if(i % 16 == 0) {
+            ASSERT_TRUE(tree->lookup(recs[i].key, v));
+            ASSERT_EQ(v, recs[i].val);
+        } else {
+            ASSERT_FALSE(tree->lookup(recs[i].key, v));
+        }
+    }
+
+    // scans go through the merged leaves
+    Record buf[64];
+    ASSERT_EQ(tree->scan(recs[0].key, 64, buf), 64);
+    for(int i = 0; i < 64; i++) {
+        ASSERT_EQ((uint64_t)buf[i].val, (uint64_t)i * 16);
+    }
+
+    // the tree keeps growing from the merged leaves
+    for(int i = 0; i < scale; i++) {
+        if(i % 16 != 0) tree->insert(recs[i].key, recs[i].val);
+    }
+    for(int i = 0; i < scale; i++) {
+        ASSERT_TRUE(tree->lookup(recs[i].key, v));
+        ASSERT_EQ(v, recs[i].val);
+    }
+    delete tree;
+}
+
+TEST(rotree, merge_right) {
+    const int scale = GLOBAL_LEAF_SIZE * 4;
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = _key_t(i);
+        recs[i].val = _val_t(i);
+    }
+
+    auto tree = new MorphtreeImpl<NodeType::ROLEAF, false>(recs);
+    std::vector<LeafStats> before;
+    tree->dump_stats(before);
+    ASSERT_GE(before.size(), 3);
+    int second = before[1].start, third = before[2].start;
+
+    // shrink the second leaf to the underflow bound, then underflow the leftmost one, 
+    // which has no left sibling and merges with the second leaf on its right
+    const int keep = UNDERFLOW_SIZE - 1;
+    for(int i = second + keep + 1; i < third; i++) {
+        ASSERT_TRUE(tree->remove(recs[i].key));
+    }
+    for(int i = keep; i < second; i++) {
+        ASSERT_TRUE(tree->remove(recs[i].key));
+    }
+    std::vector<LeafStats> after;
+    tree->dump_stats(after);
+    ASSERT_EQ(after.size(), before.size() - 1);
+
+    _val_t v;
+    for(int i = 0; i < scale; i++) {
+        bool kept = i < keep || (i >= second && i <= second + keep) || i >= third;
+        ASSERT_EQ(tree->lookup(recs[i].key, v), kept);
+        if(kept) ASSERT_EQ(v, recs[i].val);
+    }
+
+    Record buf[keep * 2 + 2];
+    ASSERT_EQ(tree->scan(recs[0].key, keep * 2 + 2, buf), keep * 2 + 2);
+    ASSERT_EQ((uint64_t)buf[keep].val, (uint64_t)second);
+    ASSERT_EQ((uint64_t)buf[keep * 2 + 1].val, (uint64_t)third);
+    delete tree;
+}
+
+TEST(rotree, merge_clustered) {
+    // clustered keys grown from an empty tree, so that the root routes its leaves through 
+    // buckets and overflow nodes, then removed until the leaves merge
+    const int scale = GLOBAL_LEAF_SIZE * 32;
+    std::default_random_engine gen(997);
+    std::normal_distribution<double> cluster(0, 1e4);
+    std::map<_key_t, _val_t> ref;
+    auto tree = new MorphtreeImpl<NodeType::ROLEAF, false>();
+    while(ref.size() < scale) {
+        _key_t k = std::floor(gen() % 16 * 1e8 + cluster(gen));
+        _val_t v = _val_t((uint64_t)ref.size() + 1);
+        tree->insert(k, v);
+        ref[k] = v;
+    }
+    std::vector<LeafStats> before;
+    tree->dump_stats(before);
+    ASSERT_GE(before.size(), (size_t)ROInner::BNODE_SIZE);
+
+    // remove most of the keys in random order, mixed with inserts of new ones
+    std::vector<_key_t> keys;
+    for(auto & r : ref) keys.push_back(r.first);
+    std::shuffle(keys.begin(), keys.end(), gen);
+    for(int i = 0; i < scale * 7 / 8; i++) {
+        ASSERT_TRUE(tree->remove(keys[i]));
+        ref.erase(keys[i]);
+        if(i % 8 == 0) {
+            _key_t k = std::floor(gen() % 16 * 1e8 + cluster(gen)) + 0.5;
+            tree->insert(k, _val_t((uint64_t)i));
+            ref[k] = _val_t((uint64_t)i);
+        }
+    }
+    std::vector<LeafStats> after;
+    tree->dump_stats(after);
+    ASSERT_LT(after.size(), before.size());
+
+    _val_t v;
+    for(auto & r : ref) {
+        ASSERT_TRUE(tree->lookup(r.first, v));
+        ASSERT_EQ(v, r.second);
+    }
+    for(int i = 0; i < scale * 7 / 8; i++) { // the new keys end in .5, the removed ones do not come back
+        ASSERT_FALSE(tree->lookup(keys[i], v));
+    }
+    delete tree;
+}
+
+TEST(rotree, delete_range_buffered) {
+    const int scale = GLOBAL_LEAF_SIZE * 16;
+    std::vector<Record> recs(scale);
+    for(uint64_t i = 0; i < scale; i++) {
+        recs[i].key = _key_t(i);
+        recs[i].val = _val_t(i);
+    }
+    auto tree = new MorphtreeImpl<NodeType::RWLEAF, false>(recs);
+
+    // upserts of keys in the buckets wait in the insert buffers, they do not count as deleted
+    const int lo = scale / 4, hi = scale * 3 / 4;
+    for(int i = lo; i < hi; i += 3) {
+        tree->insert(recs[i].key, _val_t((uint64_t)i + 1));
+    }
+    ASSERT_EQ(tree->delete_range(recs[lo].key, recs[hi].key), hi - lo);
+
+    _val_t v;
+    for(int i = 0; i < scale; i++) {
+        ASSERT_EQ(tree->lookup(recs[i].key, v), i < lo || i >= hi);
+    }
+    delete tree;
+}
+
@@ -65,7 +65,7 @@ TEST_F(wotest, update) {
     }
 }
 
-TEST_F(wotest, DISABLED_remove) {
+TEST_F(wotest, remove) {
     // remove half of the records
     for(int i = 0; i < TEST_SCALE; i += 2) {
         tree->remove(recs[i].key);
@@ -81,6 +81,38 @@ TEST_F(wotest, DISABLED_remove) {
             ASSERT_EQ(v, _val_t(recs[i].val));
         }
     }
+
+    // scans skip the removed keys, and the leaves have reclaimed their room
+    std::vector<bool> removed(TEST_SCALE, false);
+    for(int i = 0; i < TEST_SCALE; i += 2) {
+        removed[(uint64_t)recs[i].key] = true;
+    }
+    Record buf[1000];
+    int count = tree->scan(0, 1000, buf);
+    ASSERT_EQ(count, 1000);
+    for(int j = 0, k = 0; j < count; j++, k++) {
+        while(removed[k]) k++;
+        ASSERT_EQ(buf[j].key, _key_t(k));
+    }
+    ASSERT_GT(tree->reclaimed(), 0);
+}
+
+TEST_F(wotest, delete_range) {
+    // older versions and removed records in the range do not count as deleted
+    const uint64_t lo = TEST_SCALE / 4, hi = TEST_SCALE / 2;
+    for(uint64_t k = lo; k < hi; k += 3) {
+        tree->insert(_key_t(k), _val_t(k + 1));
+    }
+    int removed = 0;
+    for(uint64_t k = lo + 1; k < hi; k += 7) {
+        removed += tree->remove(_key_t(k));
+    }
+    ASSERT_EQ(tree->delete_range(_key_t(lo), _key_t(hi)), hi - lo - removed);
+
+    _val_t v;
+    for(uint64_t k = 0; k < TEST_SCALE; k += 5) {
+        ASSERT_EQ(tree->lookup(_key_t(k), v), k < lo || k >= hi);
+    }
 }
 
 // scan test is predicated on that key/values are sequencial number for 0 to TEST_SCALE - 1